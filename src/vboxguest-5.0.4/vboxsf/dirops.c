@@ -18,8 +18,451 @@
 
 #include "vfsmod.h"
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+/* what sf_new_inode() looks up cached inodes by */
+struct sf_inode_key
+{
+    ino_t ino;
+    RTDEV host_dev;
+    RTINODE host_ino;
+    struct sf_path *path;
+};
+
+static int sf_inode_test(struct inode *inode, void *data)
+{
+    struct sf_inode_key *key = data;
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+
+    /* inodes without host id (iunique() numbers, the root) never match */
+    if (   inode->i_ino != key->ino
+        || sf_i->host_ino != key->host_ino
+        || sf_i->host_dev != key->host_dev)
+        return 0;
+
+    /* hardlinks share the host id, but the host is called by path, so
+       each name gets its own inode (with the same inode number) */
+    return sf_path_equal(sf_i->path, key->path);
+}
+
+static int sf_inode_set(struct inode *inode, void *data)
+{
+    struct sf_inode_key *key = data;
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+
+    inode->i_ino = key->ino;
+    sf_i->host_ino = key->host_ino;
+    sf_i->host_dev = key->host_dev;
+    sf_i->path = key->path;
+    return 0;
+}
+#endif
+
+/**
+ * Get the inode for the host object at [path] with the attributes [info].
+ * If the host tells the object id, the inode number is derived from it and
+ * an inode still cached from an earlier lookup of [path] is reused together
+ * with its page cache, otherwise a new inode with a made up number is
+ * created.
+ *
+ * @param sb            super block
+ * @param path          path component of the object, its reference is
+ *                      passed to the inode (or dropped) on success
+ * @param info          attributes of the object
+ * @returns the (unlocked) inode, NULL if out of memory
+ */
+static struct inode *sf_new_inode(struct super_block *sb, struct sf_path *path,
+                                  PSHFLFSOBJINFO info)
+{
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(sb);
+    struct inode *inode;
+    ino_t ino;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+    ino = sf_host_ino(info);
+    if (ino)
+    {
+        struct sf_inode_key key;
+
+        key.ino = ino;
+        key.host_dev = info->Attr.u.Unix.INodeIdDevice;
+        key.host_ino = info->Attr.u.Unix.INodeId;
+        key.path = path;
+        inode = iget5_locked(sb, ino, sf_inode_test, sf_inode_set, &key);
+        if (!inode)
+        {
+            LogFunc(("iget5_locked failed\n"));
+            return NULL;
+        }
+
+        if (!(inode->i_state & I_NEW))
+        {
+            SHFLFSOBJINFO copy = *info;
+
+            sf_path_put(path);
+            sf_inode_refresh(inode, &copy);
+            return inode;
+        }
+
+        sf_init_inode(sf_g, inode, info);
+        sf_inode_attr_reset(inode);
+        unlock_new_inode(inode);
+        return inode;
+    }
+#endif
+
+    ino = iunique(sb, 1);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
+    inode = iget_locked(sb, ino);
+#else
+    inode = iget(sb, ino);
+#endif
+    if (!inode)
+    {
+        LogFunc(("iget failed\n"));
+        return NULL;
+    }
+
+    GET_INODE_INFO(inode)->path = path;
+    sf_init_inode(sf_g, inode, info);
+    sf_inode_attr_reset(inode);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
+    unlock_new_inode(inode);
+#endif
+    return inode;
+}
+
 /**
- * Open a directory. Read the complete content into a buffer.
+ * Open the directory [sf_i] on the host for reading.
+ *
+ * @returns 0 on success, Linux error code otherwise
+ */
+static int sf_dir_open_host(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                            SHFLHANDLE *pHandle)
+{
+    int rc;
+    SHFLCREATEPARMS params;
+    SHFLSTRING *path;
+
+    RT_ZERO(params);
+    params.Handle = SHFL_HANDLE_NIL;
+    params.CreateFlags = 0
+                       | SHFL_CF_DIRECTORY
+                       | SHFL_CF_ACT_OPEN_IF_EXISTS
+                       | SHFL_CF_ACT_FAIL_IF_NEW
+                       | SHFL_CF_ACCESS_READ
+                       ;
+
+    path = sf_path_str(sf_i->path);
+    if (IS_ERR(path))
+        return PTR_ERR(path);
+    LogFunc(("sf_dir_open_host(): calling vboxCallCreate, folder %s, flags %#x\n",
+             path->String.utf8, params.CreateFlags));
+    rc = vboxCallCreate(&client_handle, &sf_g->map, path, &params);
+    sf_path_str_done(path);
+    if (RT_FAILURE(rc))
+        return -EPERM;
+
+    if (params.Result != SHFL_FILE_EXISTS)
+    {
+        rc = vboxCallClose(&client_handle, &sf_g->map, params.Handle);
+        if (RT_FAILURE(rc))
+            LogFunc(("sf_dir_open_host(): vboxCallClose(%s) failed rc=%Rrc\n",
+                     sf_i->path->name, rc));
+        return -ENOENT;
+    }
+
+    *pHandle = params.Handle;
+    return 0;
+}
+
+/*
+ * The listings cached on the directory inodes of all mounts are kept on a
+ * list, least recently used first.  Once they take more than
+ * dir_cache_size bytes the oldest ones are dropped from their inodes and
+ * read again from the host on the next open.  sf_dir_cache_lock protects
+ * the list, sf_dir_cache_used and the dir_cache pointer of all inodes.
+ */
+static DEFINE_SPINLOCK(sf_dir_cache_lock);
+static LIST_HEAD(sf_dir_cache_lru);
+static size_t sf_dir_cache_used;
+
+static int dir_cache_size = SF_DIR_CACHE_SIZE_DEFAULT;
+module_param(dir_cache_size, int, 0644);
+MODULE_PARM_DESC(dir_cache_size, "Memory in bytes for the directory listings cached on the inodes");
+
+/* memory taken by the listing [sf_d] and its index */
+static size_t sf_dir_info_size(struct sf_dir_info *sf_d)
+{
+    struct list_head *pos;
+    size_t cb = 0;
+
+    list_for_each(pos, &sf_d->info_list)
+        cb += DIR_BUFFER_SIZE
+            + list_entry(pos, struct sf_dir_buf, head)->cEntries * sizeof(*sf_d->index);
+    return cb;
+}
+
+/* take the cached listing [sf_d] off its inode and the list, the caller
+   holds sf_dir_cache_lock and drops the reference of the cache */
+static void sf_dir_cache_unlink(struct sf_dir_info *sf_d)
+{
+    sf_d->sf_i->dir_cache = NULL;
+    sf_d->sf_i = NULL;
+    list_del_init(&sf_d->lru);
+    sf_dir_cache_used -= sf_d->cbCached;
+}
+
+/**
+ * Cache the listing [sf_d] on the directory [sf_i], taking a reference
+ * for the cache, and drop the listings exceeding dir_cache_size.
+ */
+static void sf_dir_cache_set(struct sf_inode_info *sf_i, struct sf_dir_info *sf_d)
+{
+    LIST_HEAD(drop);
+    struct sf_dir_info *old;
+    size_t max = (size_t)RT_MAX(ACCESS_ONCE(dir_cache_size), 0);
+
+    atomic_inc(&sf_d->refs);
+    sf_d->cbCached = sf_dir_info_size(sf_d);
+
+    spin_lock(&sf_dir_cache_lock);
+    old = sf_i->dir_cache;
+    if (old)
+    {
+        sf_dir_cache_unlink(old);
+        list_add(&old->lru, &drop);
+    }
+    sf_i->dir_cache = sf_d;
+    sf_d->sf_i = sf_i;
+    list_add_tail(&sf_d->lru, &sf_dir_cache_lru);
+    sf_dir_cache_used += sf_d->cbCached;
+
+    /* the new listing stays even if it alone exceeds the limit, the
+       caller is about to use it */
+    while (sf_dir_cache_used > max)
+    {
+        old = list_first_entry(&sf_dir_cache_lru, struct sf_dir_info, lru);
+        if (old == sf_d)
+            break;
+        sf_dir_cache_unlink(old);
+        list_add(&old->lru, &drop);
+    }
+    spin_unlock(&sf_dir_cache_lock);
+
+    while (!list_empty(&drop))
+    {
+        old = list_first_entry(&drop, struct sf_dir_info, lru);
+        list_del_init(&old->lru);
+        sf_dir_info_put(old);
+    }
+}
+
+/**
+ * Drop the listing cached on the directory [sf_i], if any.
+ */
+void sf_dir_cache_drop(struct sf_inode_info *sf_i)
+{
+    struct sf_dir_info *sf_d;
+
+    spin_lock(&sf_dir_cache_lock);
+    sf_d = sf_i->dir_cache;
+    if (sf_d)
+        sf_dir_cache_unlink(sf_d);
+    spin_unlock(&sf_dir_cache_lock);
+
+    if (sf_d)
+        sf_dir_info_put(sf_d);
+}
+
+/**
+ * Return the listing cached on the directory [inode] with a reference held
+ * for the caller, NULL if there is none or it is outdated.
+ */
+static struct sf_dir_info *sf_dir_get_cached(struct sf_inode_info *sf_i)
+{
+    struct sf_dir_info *sf_d;
+
+    spin_lock(&sf_dir_cache_lock);
+    sf_d = sf_i->dir_cache;
+    if (sf_d && !sf_i->force_reread)
+    {
+        atomic_inc(&sf_d->refs);
+        list_move_tail(&sf_d->lru, &sf_dir_cache_lru);
+    }
+    else
+        sf_d = NULL;
+    spin_unlock(&sf_dir_cache_lock);
+    return sf_d;
+}
+
+/**
+ * Return the listing of the directory [inode] with a reference held for
+ * the caller.  The listing cached on the inode is shared by all opens and
+ * is only read again from the host after the directory changed, i.e. when
+ * sf_i->force_reread was set by a local modification or by a revalidation
+ * which noticed a new mtime.
+ *
+ * @param inode     directory inode
+ * @returns the listing, ERR_PTR with a Linux error code otherwise
+ */
+static struct sf_dir_info *sf_dir_get_listing(struct inode *inode)
+{
+    int rc;
+    int err;
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+    struct sf_dir_info *sf_d;
+    SHFLHANDLE handle;
+
+    sf_d = sf_dir_get_cached(sf_i);
+    if (sf_d)
+        return sf_d;
+
+    /* cleared before reading, so that a modification racing with the read
+       below leaves the flag set for the next caller */
+    sf_i->force_reread = 0;
+
+    sf_d = sf_dir_info_alloc();
+    if (!sf_d)
+    {
+        LogRelFunc(("could not allocate directory info for '%s'\n",
+                    sf_i->path->name));
+        sf_i->force_reread = 1;
+        return ERR_PTR(-ENOMEM);
+    }
+
+    err = sf_dir_open_host(sf_g, sf_i, &handle);
+    if (!err)
+    {
+        err = sf_dir_read_all(sf_g, sf_i, sf_d, handle);
+
+        rc = vboxCallClose(&client_handle, &sf_g->map, handle);
+        if (RT_FAILURE(rc))
+            LogFunc(("sf_dir_get_listing(): vboxCallClose(%s) after err=%d failed rc=%Rrc\n",
+                     sf_i->path->name, err, rc));
+    }
+
+    if (err)
+    {
+        sf_i->force_reread = 1;
+        sf_dir_info_free(sf_d);
+        return ERR_PTR(err);
+    }
+
+    /* one reference for the cache, one for the caller */
+    sf_dir_cache_set(sf_i, sf_d);
+    return sf_d;
+}
+
+/**
+ * dirstream: open the directory on the host for reading it batch by batch
+ * from sf_getdent().  Only one batch is kept in memory.
+ *
+ * @returns 0 on success, Linux error code otherwise
+ */
+static int sf_dir_stream_open(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                              struct sf_dir_file *sf_f)
+{
+    int err;
+
+    sf_f->b = sf_dir_buf_alloc();
+    if (!sf_f->b)
+        return -ENOMEM;
+
+    err = sf_dir_open_host(sf_g, sf_i, &sf_f->handle);
+    if (err)
+    {
+        sf_dir_buf_free(sf_f->b);
+        sf_f->b = NULL;
+        return err;
+    }
+
+    sf_f->b_pos = 0;
+    sf_f->cur = sf_f->b->buf;
+    sf_f->cur_idx = 0;
+    sf_f->eof = 0;
+    return 0;
+}
+
+/**
+ * dirstream: close the host handle and free the batch.
+ */
+static void sf_dir_stream_close(struct sf_glob_info *sf_g, struct sf_dir_file *sf_f)
+{
+    int rc;
+
+    if (sf_f->handle != SHFL_HANDLE_NIL)
+    {
+        rc = vboxCallClose(&client_handle, &sf_g->map, sf_f->handle);
+        if (RT_FAILURE(rc))
+            LogFunc(("sf_dir_stream_close(): vboxCallClose failed rc=%Rrc\n", rc));
+        sf_f->handle = SHFL_HANDLE_NIL;
+    }
+    if (sf_f->b)
+    {
+        sf_dir_buf_free(sf_f->b);
+        sf_f->b = NULL;
+    }
+}
+
+/**
+ * dirstream: find the entry at position [pos], fetching batches from the
+ * host until it is in memory.  [pos] must not be before the current batch.
+ *
+ * @returns 0 for success, 1 for end reached, Linux error code otherwise.
+ */
+static int sf_dir_stream_entry(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                               struct sf_dir_file *sf_f, loff_t pos,
+                               SHFLDIRINFO **ppInfo)
+{
+    struct sf_dir_buf *b = sf_f->b;
+    size_t idx;
+
+    while (pos >= sf_f->b_pos + (loff_t)b->cEntries)
+    {
+        int err;
+
+        if (sf_f->eof)
+            return 1;
+
+        sf_f->b_pos += b->cEntries;
+        sf_f->cur = b->buf;
+        sf_f->cur_idx = 0;
+        sf_f->b_time = jiffies;
+        err = sf_dir_read_batch(sf_g, sf_i, sf_f->handle, b);
+        if (err)
+        {
+            /* don't ask the host again after a failure */
+            sf_f->eof = 1;
+            if (err < 0)
+                return err;
+        }
+    }
+
+    idx = pos - sf_f->b_pos;
+    if (idx < sf_f->cur_idx)
+    {
+        sf_f->cur = b->buf;
+        sf_f->cur_idx = 0;
+    }
+    while (sf_f->cur_idx < idx)
+    {
+        sf_f->cur = (SHFLDIRINFO *)((uintptr_t)sf_f->cur
+                                    + offsetof(SHFLDIRINFO, name.String)
+                                    + sf_f->cur->name.u16Size);
+        sf_f->cur_idx++;
+    }
+
+    *ppInfo = sf_f->cur;
+    return 0;
+}
+
+/**
+ * Open a directory. Take a reference to the listing cached on the inode,
+ * reading it from the host if the directory changed since.  With the
+ * dirstream mount option an outdated listing is not read completely but
+ * streamed by sf_getdent() instead.
  *
  * @param inode     inode
  * @param file      file
@@ -27,12 +470,11 @@
  */
 static int sf_dir_open(struct inode *inode, struct file *file)
 {
-    int rc;
     int err;
     struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_dir_file *sf_f;
     struct sf_dir_info *sf_d;
     struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
-    SHFLCREATEPARMS params;
 
     TRACE();
     BUG_ON(!sf_g);
@@ -41,60 +483,60 @@ static int sf_dir_open(struct inode *inode, struct file *file)
     if (file->private_data)
     {
         LogFunc(("sf_dir_open() called on already opened directory '%s'\n",
-                sf_i->path->String.utf8));
+                sf_i->path->name));
         return 0;
     }
 
-    sf_d = sf_dir_info_alloc();
-    if (!sf_d)
+    /* notices host side changes of the directory (e.g. opening "." skips
+       d_revalidate), limited by the attribute cache like any other stat */
+    err = sf_inode_revalidate(GET_F_DENTRY(file));
+    if (err)
+        return err;
+
+    sf_f = sf_dir_file_alloc();
+    if (!sf_f)
     {
-        LogRelFunc(("could not allocate directory info for '%s'\n",
-                    sf_i->path->String.utf8));
+        LogRelFunc(("could not allocate directory file info for '%s'\n",
+                    sf_i->path->name));
         return -ENOMEM;
     }
+    RT_ZERO(*sf_f);
+    sf_f->handle = SHFL_HANDLE_NIL;
 
-    RT_ZERO(params);
-    params.Handle = SHFL_HANDLE_NIL;
-    params.CreateFlags = 0
-                       | SHFL_CF_DIRECTORY
-                       | SHFL_CF_ACT_OPEN_IF_EXISTS
-                       | SHFL_CF_ACT_FAIL_IF_NEW
-                       | SHFL_CF_ACCESS_READ
-                       ;
-
-    LogFunc(("sf_dir_open(): calling vboxCallCreate, folder %s, flags %#x\n",
-             sf_i->path->String.utf8, params.CreateFlags));
-    rc = vboxCallCreate(&client_handle, &sf_g->map, sf_i->path, &params);
-    if (RT_SUCCESS(rc))
+    if (sf_g->dirstream)
     {
-        if (params.Result == SHFL_FILE_EXISTS)
+        sf_d = sf_dir_get_cached(sf_i);
+        if (!sf_d)
         {
-            err = sf_dir_read_all(sf_g, sf_i, sf_d, params.Handle);
-            if (!err)
-                file->private_data = sf_d;
+            err = sf_dir_stream_open(sf_g, sf_i, sf_f);
+            if (err)
+                goto fail;
         }
-        else
-            err = -ENOENT;
-
-        rc = vboxCallClose(&client_handle, &sf_g->map, params.Handle);
-        if (RT_FAILURE(rc))
-            LogFunc(("sf_dir_open(): vboxCallClose(%s) after err=%d failed rc=%Rrc\n",
-                     sf_i->path->String.utf8, err, rc));
     }
     else
-        err = -EPERM;
+    {
+        sf_d = sf_dir_get_listing(inode);
+        if (IS_ERR(sf_d))
+        {
+            err = PTR_ERR(sf_d);
+            goto fail;
+        }
+    }
 
-    if (err)
-        sf_dir_info_free(sf_d);
+    sf_f->sf_d = sf_d;
+    file->private_data = sf_f;
+    return 0;
 
+fail:
+    sf_dir_file_free(sf_f);
     return err;
 }
 
 
 /**
- * This is called when reference count of [file] goes to zero. Notify
- * the host that it can free whatever is associated with this directory
- * and deallocate our own internal buffers
+ * This is called when reference count of [file] goes to zero. Drop our
+ * reference to the listing, the one cached on the inode stays for the
+ * next open.
  *
  * @param inode     inode
  * @param file      file
@@ -102,10 +544,17 @@ static int sf_dir_open(struct inode *inode, struct file *file)
  */
 static int sf_dir_release(struct inode *inode, struct file *file)
 {
+    struct sf_dir_file *sf_f = file->private_data;
+
     TRACE();
 
-    if (file->private_data)
-        sf_dir_info_free(file->private_data);
+    if (sf_f)
+    {
+        sf_dir_stream_close(GET_GLOB_INFO(inode->i_sb), sf_f);
+        if (sf_f->sf_d)
+            sf_dir_info_put(sf_f->sf_d);
+        sf_dir_file_free(sf_f);
+    }
 
     return 0;
 }
@@ -134,103 +583,179 @@ static int sf_get_d_type(RTFMODE fMode)
 }
 
 /**
- * Extract element ([dir]->f_pos) from the directory [dir] into [d_name].
+ * Extract element ([dir]->f_pos) from the directory [dir] into [d_name],
+ * its attributes are returned in [ppInfo] and when they were read from
+ * the host in [pFetched].
  *
  * @returns 0 for success, 1 for end reached, Linux error code otherwise.
  */
-static int sf_getdent(struct file *dir, char d_name[NAME_MAX], int *d_type)
+static int sf_getdent(struct file *dir, char d_name[NAME_MAX], int *d_type,
+                      PSHFLFSOBJINFO *ppInfo, unsigned long *pFetched)
 {
-    loff_t cur;
     struct sf_glob_info *sf_g;
+    struct sf_dir_file *sf_f;
     struct sf_dir_info *sf_d;
     struct sf_inode_info *sf_i;
     struct inode *inode;
-    struct list_head *pos, *list;
+    SHFLDIRINFO *info;
 
     TRACE();
 
     inode = GET_F_DENTRY(dir)->d_inode;
     sf_i = GET_INODE_INFO(inode);
     sf_g = GET_GLOB_INFO(inode->i_sb);
-    sf_d = dir->private_data;
+    sf_f = dir->private_data;
 
     BUG_ON(!sf_g);
-    BUG_ON(!sf_d);
+    BUG_ON(!sf_f);
     BUG_ON(!sf_i);
 
-    if (sf_i->force_reread)
-    {
-        int rc;
-        int err;
-        SHFLCREATEPARMS params;
-
-        RT_ZERO(params);
-        params.Handle = SHFL_HANDLE_NIL;
-        params.CreateFlags = 0
-                           | SHFL_CF_DIRECTORY
-                           | SHFL_CF_ACT_OPEN_IF_EXISTS
-                           | SHFL_CF_ACT_FAIL_IF_NEW
-                           | SHFL_CF_ACCESS_READ
-                           ;
+    if (dir->f_pos < 0)
+        return 1;
 
-        LogFunc(("sf_getdent: calling vboxCallCreate, folder %s, flags %#x\n",
-                  sf_i->path->String.utf8, params.CreateFlags));
-        rc = vboxCallCreate(&client_handle, &sf_g->map, sf_i->path, &params);
-        if (RT_FAILURE(rc))
+    if (!sf_f->sf_d)
+    {
+        if (dir->f_pos >= sf_f->b_pos)
         {
-            LogFunc(("vboxCallCreate(%s) failed rc=%Rrc\n",
-                        sf_i->path->String.utf8, rc));
-            return -EPERM;
+            int err = sf_dir_stream_entry(sf_g, sf_i, sf_f, dir->f_pos, &info);
+            if (err)
+                return err;
+            *pFetched = sf_f->b_time;
+            goto found;
         }
 
-        if (params.Result != SHFL_FILE_EXISTS)
-        {
-            LogFunc(("directory %s does not exist\n", sf_i->path->String.utf8));
-            sf_dir_info_free(sf_d);
-            return -ENOENT;
-        }
+        /* seeking back before the current batch, continue with a
+           complete listing */
+        sf_d = sf_dir_get_listing(inode);
+        if (IS_ERR(sf_d))
+            return PTR_ERR(sf_d);
+        sf_dir_stream_close(sf_g, sf_f);
+        sf_f->sf_d = sf_d;
+    }
 
-        sf_dir_info_empty(sf_d);
-        err = sf_dir_read_all(sf_g, sf_i, sf_d, params.Handle);
-        rc = vboxCallClose(&client_handle, &sf_g->map, params.Handle);
-        if (RT_FAILURE(rc))
-            LogFunc(("vboxCallClose(%s) failed rc=%Rrc\n", sf_i->path->String.utf8, rc));
-        if (err)
-            return err;
+    sf_d = sf_f->sf_d;
+    if (sf_i->force_reread)
+    {
+        struct sf_dir_info *sf_new = sf_dir_get_listing(inode);
+        if (IS_ERR(sf_new))
+            return PTR_ERR(sf_new);
 
-        sf_i->force_reread = 0;
+        sf_dir_info_put(sf_d);
+        sf_f->sf_d = sf_d = sf_new;
     }
 
-    cur = 0;
-    list = &sf_d->info_list;
-    list_for_each(pos, list)
+    if (!sf_d->index)
     {
-        struct sf_dir_buf *b;
-        SHFLDIRINFO *info;
-        loff_t i;
+        int err = sf_dir_info_index(sf_d);
+        if (err)
+            return err;
+    }
+
+    if (dir->f_pos >= sf_d->cEntries)
+        return 1;
+
+    info = sf_d->index[dir->f_pos];
+    *pFetched = sf_d->fetched;
+
+found:
+    *d_type = sf_get_d_type(info->Info.Attr.fMode);
+    *ppInfo = &info->Info;
 
-        b = list_entry(pos, struct sf_dir_buf, head);
-        if (dir->f_pos >= cur + b->cEntries)
+    return sf_nlscpy(sf_g, d_name, NAME_MAX,
+                     info->name.String.utf8, info->name.u16Length);
+}
+
+/**
+ * Feed the entry [d_name] of the listing of [dir] with the attributes
+ * [info] read from the host at [fetched] into the dcache, like NFS does
+ * with READDIRPLUS, so that the stat() following a readdir() needs no host
+ * lookup.  An existing dentry only gets its inode updated.  The caller
+ * holds the directory's i_mutex, which serializes us with sf_lookup().
+ */
+static void sf_dir_prime(struct file *dir, const char *d_name, PSHFLFSOBJINFO info,
+                         unsigned long fetched)
+{
+    struct dentry *parent = GET_F_DENTRY(dir);
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(parent->d_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(parent->d_inode);
+    struct dentry *dentry;
+    struct inode *inode;
+    struct qstr name;
+    struct sf_path *path;
+
+    if (d_name[0] == '.' && (!d_name[1] || (d_name[1] == '.' && !d_name[2])))
+        return;
+
+    /* a listing cached for longer than the directory attributes are
+       trusted may be outdated */
+    if (time_after(jiffies, fetched + sf_g->acdirmin))
+        return;
+
+    name.name = d_name;
+    name.len = strlen(d_name);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+    name.hash = full_name_hash(parent, name.name, name.len);
+#else
+    name.hash = full_name_hash(name.name, name.len);
+#endif
+
+    dentry = d_lookup(parent, &name);
+    if (dentry)
+    {
+        /* don't touch an inode which changed its type on the host, the
+           next revalidation replaces it */
+        inode = dentry->d_inode;
+        if (!inode)
+            /* the name exists after all, drop the negative dentries */
+            sf_i->dir_stamp = jiffies;
+        else if (   ((inode->i_mode & S_IFMT) >> 12) == sf_get_d_type(info->Attr.fMode)
+                 /* not over attributes fetched after the listing */
+                 && time_before(GET_INODE_INFO(inode)->attr_time, fetched))
         {
-            cur += b->cEntries;
-            continue;
+            SHFLFSOBJINFO copy = *info;
+            sf_inode_update(dentry, &copy);
         }
+        dput(dentry);
+        return;
+    }
 
-        for (i = 0, info = b->buf; i < dir->f_pos - cur; ++i)
-        {
-            size_t size;
+    dentry = d_alloc(parent, &name);
+    if (!dentry)
+        return;
 
-            size = offsetof(SHFLDIRINFO, name.String) + info->name.u16Size;
-            info = (SHFLDIRINFO *) ((uintptr_t) info + size);
-        }
+    if (sf_path_from_dentry(__func__, sf_g, sf_i, dentry, &path))
+        goto out;
 
-        *d_type = sf_get_d_type(info->Info.Attr.fMode);
+    inode = sf_new_inode(parent->d_sb, path, info);
+    if (!inode)
+    {
+        sf_path_put(path);
+        goto out;
+    }
 
-        return sf_nlscpy(sf_g, d_name, NAME_MAX,
-                         info->name.String.utf8, info->name.u16Length);
+    if (S_ISDIR(inode->i_mode))
+    {
+        /* a directory must not get a second dentry, leave a cached one
+           still in use (e.g. an unhashed cwd) to sf_lookup() */
+        struct dentry *alias = d_find_alias(inode);
+        if (alias)
+        {
+            dput(alias);
+            iput(inode);
+            goto out;
+        }
     }
 
-    return 1;
+    dentry->d_time = jiffies;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+    d_set_d_op(dentry, &sf_dentry_ops);
+#else
+    dentry->d_op = &sf_dentry_ops;
+#endif
+    d_add(dentry, inode);
+
+out:
+    dput(dentry);
 }
 
 /**
@@ -270,8 +795,10 @@ static int sf_dir_read(struct file *dir, void *opaque, filldir_t filldir)
         loff_t sanity;
         char d_name[NAME_MAX];
         int d_type = DT_UNKNOWN;
+        PSHFLFSOBJINFO info;
+        unsigned long fetched;
 
-        err = sf_getdent(dir, d_name, &d_type);
+        err = sf_getdent(dir, d_name, &d_type, &info, &fetched);
         switch (err)
         {
             case 1:
@@ -293,16 +820,21 @@ static int sf_dir_read(struct file *dir, void *opaque, filldir_t filldir)
 
         /* d_name now contains a valid entry name */
 
+        /* the inode number stat() will report, if the host tells */
+        fake_ino = sf_host_ino(info);
+        if (!fake_ino)
+        {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
-        sanity = ctx->pos + 0xbeef;
+            sanity = ctx->pos + 0xbeef;
 #else
-        sanity = dir->f_pos + 0xbeef;
+            sanity = dir->f_pos + 0xbeef;
 #endif
-        fake_ino = sanity;
-        if (sanity - fake_ino)
-        {
-            LogRelFunc(("can not compute ino\n"));
-            return -EINVAL;
+            fake_ino = sanity;
+            if (sanity - fake_ino)
+            {
+                LogRelFunc(("can not compute ino\n"));
+                return -EINVAL;
+            }
         }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
@@ -322,6 +854,8 @@ static int sf_dir_read(struct file *dir, void *opaque, filldir_t filldir)
         }
 #endif
 
+        sf_dir_prime(dir, d_name, info, fetched);
+
         dir->f_pos += 1;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
         ctx->pos += 1;
@@ -367,11 +901,10 @@ static struct dentry *sf_lookup(struct inode *parent, struct dentry *dentry
                                )
 {
     int err;
-    struct sf_inode_info *sf_i, *sf_new_i;
+    struct sf_inode_info *sf_i;
     struct sf_glob_info *sf_g;
-    SHFLSTRING *path;
+    struct sf_path *path;
     struct inode *inode;
-    ino_t ino;
     SHFLFSOBJINFO fsinfo;
 
     TRACE();
@@ -392,7 +925,7 @@ static struct dentry *sf_lookup(struct inode *parent, struct dentry *dentry
         {
             /* -ENOENT: add NULL inode to dentry so it later can be
                created via call to create/mkdir/open */
-            kfree(path);
+            sf_path_put(path);
             inode = NULL;
         }
         else
@@ -400,36 +933,12 @@ static struct dentry *sf_lookup(struct inode *parent, struct dentry *dentry
     }
     else
     {
-        sf_new_i = kmalloc(sizeof(*sf_new_i), GFP_KERNEL);
-        if (!sf_new_i)
-        {
-            LogRelFunc(("could not allocate memory for new inode info\n"));
-            err = -ENOMEM;
-            goto fail1;
-        }
-        sf_new_i->handle = SHFL_HANDLE_NIL;
-        sf_new_i->force_reread = 0;
-
-        ino = iunique(parent->i_sb, 1);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
-        inode = iget_locked(parent->i_sb, ino);
-#else
-        inode = iget(parent->i_sb, ino);
-#endif
+        inode = sf_new_inode(parent->i_sb, path, &fsinfo);
         if (!inode)
         {
-            LogFunc(("iget failed\n"));
             err = -ENOMEM;          /* XXX: ??? */
-            goto fail2;
+            goto fail1;
         }
-
-        SET_INODE_INFO(inode, sf_new_i);
-        sf_init_inode(sf_g, inode, &fsinfo);
-        sf_new_i->path = path;
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
-        unlock_new_inode(inode);
-#endif
     }
 
     sf_i->force_restat = 0;
@@ -439,36 +948,84 @@ static struct dentry *sf_lookup(struct inode *parent, struct dentry *dentry
 #else
     dentry->d_op = &sf_dentry_ops;
 #endif
+    /* the inode may be cached from an earlier lookup, a directory must
+       then keep its single dentry */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+    return d_splice_alias(inode, dentry);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 17)
+    return d_materialise_unique(dentry, inode);
+#else
     d_add(dentry, inode);
     return NULL;
-
-fail2:
-    kfree(sf_new_i);
+#endif
 
 fail1:
-    kfree(path);
+    sf_path_put(path);
 
 fail0:
     return ERR_PTR(err);
 }
 
 /**
- * This should allocate memory for sf_inode_info, compute a unique inode
- * number, get an inode from vfs, initialize inode info, instantiate
- * dentry.
+ * Leave the host [handle] opened with the SHFL_CF_ACCESS_* flags [fFlags]
+ * in [sf_i] for the following sf_reg_open().
+ */
+static void sf_inode_set_handle(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                                SHFLHANDLE handle, uint32_t fFlags)
+{
+    SHFLHANDLE old;
+    int rc;
+
+    spin_lock(&sf_i->handle_lock);
+    old = sf_i->handle;
+    sf_i->handle = handle;
+    sf_i->handle_flags = fFlags;
+    spin_unlock(&sf_i->handle_lock);
+
+    /* a stale inode of a host object which had the same id and path may
+       still hold the handle of its creation */
+    if (old != SHFL_HANDLE_NIL)
+    {
+        rc = vboxCallClose(&client_handle, &sf_g->map, old);
+        if (RT_FAILURE(rc))
+            LogFunc(("vboxCallClose failed rc=%Rrc\n", rc));
+    }
+}
+
+/* attach [inode] to [dentry], which sf_atomic_open() may pass before
+   it was looked up */
+static void sf_d_instantiate(struct dentry *dentry, struct inode *inode)
+{
+    if (d_unhashed(dentry))
+    {
+        dentry->d_time = jiffies;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+        d_set_d_op(dentry, &sf_dentry_ops);
+#else
+        dentry->d_op = &sf_dentry_ops;
+#endif
+        d_add(dentry, inode);
+    }
+    else
+        d_instantiate(dentry, inode);
+}
+
+/**
+ * Get the inode for a newly created host object (see sf_new_inode())
+ * and instantiate the dentry.
  *
  * @param parent        inode entry of the directory
  * @param dentry        directory cache entry
  * @param path          path name
  * @param info          file information
  * @param handle        handle
+ * @param fFlags        SHFL_CF_ACCESS_* flags of the handle
  * @returns 0 on success, Linux error code otherwise
  */
 static int sf_instantiate(struct inode *parent, struct dentry *dentry,
-                          SHFLSTRING *path, PSHFLFSOBJINFO info, SHFLHANDLE handle)
+                          struct sf_path *path, PSHFLFSOBJINFO info,
+                          SHFLHANDLE handle, uint32_t fFlags)
 {
-    int err;
-    ino_t ino;
     struct inode *inode;
     struct sf_inode_info *sf_new_i;
     struct sf_glob_info *sf_g = GET_GLOB_INFO(parent->i_sb);
@@ -476,49 +1033,23 @@ static int sf_instantiate(struct inode *parent, struct dentry *dentry,
     TRACE();
     BUG_ON(!sf_g);
 
-    sf_new_i = kmalloc(sizeof(*sf_new_i), GFP_KERNEL);
-    if (!sf_new_i)
-    {
-        LogRelFunc(("could not allocate inode info.\n"));
-        err = -ENOMEM;
-        goto fail0;
-    }
-
-    ino = iunique(parent->i_sb, 1);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
-    inode = iget_locked(parent->i_sb, ino);
-#else
-    inode = iget(parent->i_sb, ino);
-#endif
+    inode = sf_new_inode(parent->i_sb, path, info);
     if (!inode)
     {
-        LogFunc(("iget failed\n"));
-        err = -ENOMEM;
-        goto fail1;
+        LogRelFunc(("could not allocate inode.\n"));
+        return -ENOMEM;
     }
 
-    sf_init_inode(sf_g, inode, info);
-    sf_new_i->path = path;
-    SET_INODE_INFO(inode, sf_new_i);
+    sf_new_i = GET_INODE_INFO(inode);
     sf_new_i->force_restat = 1;
-    sf_new_i->force_reread = 0;
-
-    d_instantiate(dentry, inode);
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
-    unlock_new_inode(inode);
-#endif
+    /* a reused directory inode has a listing of its predecessor */
+    sf_new_i->force_reread = 1;
 
     /* Store this handle if we leave the handle open. */
-    sf_new_i->handle = handle;
-    return 0;
-
-fail1:
-    kfree(sf_new_i);
-
-fail0:
-    return err;
+    sf_inode_set_handle(sf_g, sf_new_i, handle, fFlags);
 
+    sf_d_instantiate(dentry, inode);
+    return 0;
 }
 
 /**
@@ -535,7 +1066,8 @@ static int sf_create_aux(struct inode *parent, struct dentry *dentry,
 {
     int rc, err;
     SHFLCREATEPARMS params;
-    SHFLSTRING *path;
+    struct sf_path *path;
+    SHFLSTRING *str;
     struct sf_inode_info *sf_i = GET_INODE_INFO(parent);
     struct sf_glob_info *sf_g = GET_GLOB_INFO(parent->i_sb);
 
@@ -561,9 +1093,16 @@ static int sf_create_aux(struct inode *parent, struct dentry *dentry,
                            ;
     params.Info.Attr.enmAdditional = RTFSOBJATTRADD_NOTHING;
 
+    str = sf_path_str(path);
+    if (IS_ERR(str))
+    {
+        err = PTR_ERR(str);
+        goto fail1;
+    }
     LogFunc(("sf_create_aux: calling vboxCallCreate, folder %s, flags %#x\n",
-              path->String.utf8, params.CreateFlags));
-    rc = vboxCallCreate(&client_handle, &sf_g->map, path, &params);
+              str->String.utf8, params.CreateFlags));
+    rc = vboxCallCreate(&client_handle, &sf_g->map, str, &params);
+    sf_path_str_done(str);
     if (RT_FAILURE(rc))
     {
         if (rc == VERR_WRITE_PROTECT)
@@ -573,7 +1112,7 @@ static int sf_create_aux(struct inode *parent, struct dentry *dentry,
         }
         err = -EPROTO;
         LogFunc(("(%d): vboxCallCreate(%s) failed rc=%Rrc\n",
-                    fDirectory, sf_i->path->String.utf8, rc));
+                    fDirectory, sf_i->path->name, rc));
         goto fail1;
     }
 
@@ -581,16 +1120,17 @@ static int sf_create_aux(struct inode *parent, struct dentry *dentry,
     {
         err = -EPERM;
         LogFunc(("(%d): could not create file %s result=%d\n",
-                    fDirectory, sf_i->path->String.utf8, params.Result));
+                    fDirectory, sf_i->path->name, params.Result));
         goto fail1;
     }
 
     err = sf_instantiate(parent, dentry, path, &params.Info,
-                         fDirectory ? SHFL_HANDLE_NIL : params.Handle);
+                         fDirectory ? SHFL_HANDLE_NIL : params.Handle,
+                         SHFL_CF_ACCESS_READWRITE);
     if (err)
     {
         LogFunc(("(%d): could not instantiate dentry for %s err=%d\n",
-                    fDirectory, sf_i->path->String.utf8, err));
+                    fDirectory, sf_i->path->name, err));
         goto fail2;
     }
 
@@ -607,6 +1147,8 @@ static int sf_create_aux(struct inode *parent, struct dentry *dentry,
     }
 
     sf_i->force_restat = 1;
+    sf_i->force_reread = 1;
+    sf_i->dir_stamp = jiffies;
     return 0;
 
 fail2:
@@ -615,7 +1157,7 @@ fail2:
         LogFunc(("(%d): vboxCallClose failed rc=%Rrc\n", fDirectory, rc));
 
 fail1:
-    kfree(path);
+    sf_path_put(path);
 
 fail0:
     return err;
@@ -643,6 +1185,219 @@ static int sf_create(struct inode *parent, struct dentry *dentry, int mode)
     return sf_create_aux(parent, dentry, mode, 0);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
+/**
+ * Open (and create) the regular file [dentry] with a single host call
+ * which also tells its attributes, and leave the host handle to
+ * sf_reg_open().
+ *
+ * @param parent        inode of the directory
+ * @param dentry        directory cache entry, unhashed or negative
+ * @param file          file to open
+ * @param flags         open flags
+ * @param mode          file mode for O_CREAT
+ * @param opened        FILE_* open state (before 4.18)
+ * @returns 0 if [file] was opened, 1 if the name is no regular file and
+ *          the VFS has to look it up and open it the usual way, Linux
+ *          error code otherwise
+ */
+static int sf_atomic_open_aux(struct inode *parent, struct dentry *dentry,
+                              struct file *file, unsigned flags, umode_t mode,
+                              int *opened)
+{
+    int rc, err, fCreated;
+    SHFLCREATEPARMS params;
+    struct sf_path *path;
+    SHFLSTRING *str;
+    struct inode *inode;
+    struct sf_inode_info *sf_i = GET_INODE_INFO(parent);
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(parent->i_sb);
+    uint32_t fAccess = sf_access_flags(flags);
+
+    TRACE();
+    BUG_ON(!sf_g);
+
+    err = sf_path_from_dentry(__func__, sf_g, sf_i, dentry, &path);
+    if (err)
+        goto fail0;
+
+    /* O_TRUNC is left to the VFS, which truncates an existing file only
+       after checking its permissions */
+    RT_ZERO(params);
+    params.Handle = SHFL_HANDLE_NIL;
+    if (flags & O_CREAT)
+        params.CreateFlags = SHFL_CF_ACT_CREATE_IF_NEW
+                           | (flags & O_EXCL ? SHFL_CF_ACT_FAIL_IF_EXISTS
+                                             : SHFL_CF_ACT_OPEN_IF_EXISTS);
+    else
+        params.CreateFlags = SHFL_CF_ACT_FAIL_IF_NEW
+                           | SHFL_CF_ACT_OPEN_IF_EXISTS;
+    params.CreateFlags |= fAccess;
+    params.Info.Attr.fMode = RTFS_TYPE_FILE | (mode & S_IRWXUGO);
+    params.Info.Attr.enmAdditional = RTFSOBJATTRADD_NOTHING;
+
+    str = sf_path_str(path);
+    if (IS_ERR(str))
+    {
+        err = PTR_ERR(str);
+        goto fail1;
+    }
+    LogFunc(("calling vboxCallCreate, file %s, flags %#x\n",
+             str->String.utf8, params.CreateFlags));
+    rc = vboxCallCreate(&client_handle, &sf_g->map, str, &params);
+    sf_path_str_done(str);
+    if (RT_FAILURE(rc))
+    {
+        LogFunc(("vboxCallCreate(%s) failed rc=%Rrc\n", path->name, rc));
+        switch (rc)
+        {
+            case VERR_IS_A_DIRECTORY:
+            case VERR_NOT_A_FILE:
+                /* the lookup tells what it is */
+                err = 1;
+                break;
+            case VERR_WRITE_PROTECT:
+                err = -EROFS;
+                break;
+            default:
+                err = -RTErrConvertToErrno(rc);
+                break;
+        }
+        goto fail1;
+    }
+
+    if (params.Handle == SHFL_HANDLE_NIL)
+    {
+        switch (params.Result)
+        {
+            case SHFL_PATH_NOT_FOUND:
+            case SHFL_FILE_NOT_FOUND:
+                err = -ENOENT;
+                break;
+            case SHFL_FILE_EXISTS:
+                err = -EEXIST;
+                break;
+            default:
+                err = -EPROTO;
+                break;
+        }
+        goto fail1;
+    }
+
+    fCreated = params.Result == SHFL_FILE_CREATED;
+    if (fCreated)
+    {
+        err = sf_instantiate(parent, dentry, path, &params.Info,
+                             params.Handle, fAccess);
+        if (err)
+            goto fail2;
+
+        sf_i->force_restat = 1;
+        sf_i->force_reread = 1;
+        sf_i->dir_stamp = jiffies;
+    }
+    else
+    {
+        if (!RTFS_IS_FILE(params.Info.Attr.fMode))
+        {
+            err = 1;
+            goto fail2;
+        }
+
+        inode = sf_new_inode(parent->i_sb, path, &params.Info);
+        if (!inode)
+        {
+            err = -ENOMEM;
+            goto fail2;
+        }
+        sf_inode_set_handle(sf_g, GET_INODE_INFO(inode), params.Handle, fAccess);
+        sf_d_instantiate(dentry, inode);
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+    if (fCreated)
+        file->f_mode |= FMODE_CREATED;
+    return finish_open(file, dentry, NULL);
+#else
+    if (fCreated)
+        *opened |= FILE_CREATED;
+    return finish_open(file, dentry, NULL, opened);
+#endif
+
+fail2:
+    rc = vboxCallClose(&client_handle, &sf_g->map, params.Handle);
+    if (RT_FAILURE(rc))
+        LogFunc(("vboxCallClose failed rc=%Rrc\n", rc));
+
+fail1:
+    sf_path_put(path);
+
+fail0:
+    return err;
+}
+
+/**
+ * Look up, create and open a regular file in one go. A host open follows
+ * symlinks and tells the attributes of the target, so a name which was not
+ * looked up yet is only opened directly if it can't be a symlink for us:
+ * when the host resolves symlinks itself or when it must be a new file.
+ * Everything else is looked up first and then opened by sf_reg_open().
+ *
+ * @param parent        inode of the directory
+ * @param dentry        directory cache entry
+ * @param file          file to open
+ * @param flags         open flags
+ * @param mode          file mode for O_CREAT
+ * @returns 0 on success, Linux error code otherwise
+ */
+static int sf_atomic_open(struct inode *parent, struct dentry *dentry,
+                          struct file *file, unsigned flags, umode_t mode
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+                          , int *opened
+#endif
+                         )
+{
+    struct dentry *res = NULL;
+    int err;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+    int *opened = NULL;
+#endif
+
+    TRACE();
+    if (   d_unhashed(dentry)
+        && !(flags & O_DIRECTORY)
+        && (   !sf_host_symlinks
+            || (flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)))
+    {
+        err = sf_atomic_open_aux(parent, dentry, file, flags, mode, opened);
+        if (err <= 0)
+            return err;
+    }
+
+    if (d_unhashed(dentry))
+    {
+        res = sf_lookup(parent, dentry, 0);
+        if (IS_ERR(res))
+            return PTR_ERR(res);
+        if (res)
+            dentry = res;
+    }
+
+    if (!(flags & O_CREAT) || dentry->d_inode)
+        return finish_no_open(file, res);
+
+    err = sf_atomic_open_aux(parent, dentry, file, flags, mode, opened);
+    if (err > 0)
+    {
+        /* the name appeared on the host since the lookup and is no
+           regular file, let the VFS look it up again */
+        d_drop(dentry);
+        err = -ESTALE;
+    }
+    return err;
+}
+#endif
+
 /**
  * Create a new directory.
  *
@@ -674,7 +1429,8 @@ static int sf_unlink_aux(struct inode *parent, struct dentry *dentry, int fDirec
     int rc, err;
     struct sf_glob_info *sf_g = GET_GLOB_INFO(parent->i_sb);
     struct sf_inode_info *sf_i = GET_INODE_INFO(parent);
-    SHFLSTRING *path;
+    struct sf_path *path;
+    SHFLSTRING *str;
     uint32_t fFlags;
 
     TRACE();
@@ -689,11 +1445,21 @@ static int sf_unlink_aux(struct inode *parent, struct dentry *dentry, int fDirec
         && dentry->d_inode
         && ((dentry->d_inode->i_mode & S_IFLNK) == S_IFLNK))
         fFlags |= SHFL_REMOVE_SYMLINK;
-    rc = vboxCallRemove(&client_handle, &sf_g->map, path, fFlags);
+    /* cached host handles would keep the file alive (or busy) on the host */
+    if (dentry && dentry->d_inode)
+        sf_handle_invalidate(sf_g, GET_INODE_INFO(dentry->d_inode));
+    str = sf_path_str(path);
+    if (IS_ERR(str))
+    {
+        err = PTR_ERR(str);
+        goto fail1;
+    }
+    rc = vboxCallRemove(&client_handle, &sf_g->map, str, fFlags);
+    sf_path_str_done(str);
     if (RT_FAILURE(rc))
     {
         LogFunc(("(%d): vboxCallRemove(%s) failed rc=%Rrc\n", fDirectory,
-                    path->String.utf8, rc));
+                    path->name, rc));
         err = -RTErrConvertToErrno(rc);
         goto fail1;
     }
@@ -706,7 +1472,7 @@ static int sf_unlink_aux(struct inode *parent, struct dentry *dentry, int fDirec
     err = 0;
 
 fail1:
-    kfree(path);
+    sf_path_put(path);
 
 fail0:
     return err;
@@ -764,17 +1530,17 @@ static int sf_rename(struct inode *old_parent, struct dentry *old_dentry,
     {
         struct sf_inode_info *sf_old_i = GET_INODE_INFO(old_parent);
         struct sf_inode_info *sf_new_i = GET_INODE_INFO(new_parent);
-        /* As we save the relative path inside the inode structure, we need to change
-           this if the rename is successful. */
+        /* The renamed inode's path component gets the new parent and name,
+           the paths of all cached descendants follow. */
         struct sf_inode_info *sf_file_i = GET_INODE_INFO(old_dentry->d_inode);
-        SHFLSTRING *old_path;
-        SHFLSTRING *new_path;
+        struct sf_path *new_path;
+        SHFLSTRING *old_str = NULL;
+        SHFLSTRING *new_str = NULL;
 
         BUG_ON(!sf_old_i);
         BUG_ON(!sf_new_i);
         BUG_ON(!sf_file_i);
 
-        old_path = sf_file_i->path;
         err = sf_path_from_dentry(__func__, sf_g, sf_new_i,
                                   new_dentry, &new_path);
         if (err)
@@ -783,22 +1549,39 @@ static int sf_rename(struct inode *old_parent, struct dentry *old_dentry,
         {
             int fDir = ((old_dentry->d_inode->i_mode & S_IFDIR) != 0);
 
-            rc = vboxCallRename(&client_handle, &sf_g->map, old_path,
-                                new_path, fDir ? 0 : SHFL_RENAME_FILE | SHFL_RENAME_REPLACE_IF_EXISTS);
-            if (RT_SUCCESS(rc))
+            err = sf_make_path(__func__, sf_file_i->path, NULL, 0, &old_str);
+            if (!err)
+                err = sf_make_path(__func__, new_path, NULL, 0, &new_str);
+            if (!err)
             {
-                kfree(old_path);
-                sf_new_i->force_restat = 1;
-                sf_old_i->force_restat = 1; /* XXX: needed? */
-                /* Set the new relative path in the inode. */
-                sf_file_i->path = new_path;
-            }
-            else
-            {
-                LogFunc(("vboxCallRename failed rc=%Rrc\n", rc));
-                err = -RTErrConvertToErrno(rc);
-                kfree(new_path);
+                /* cached host handles may block the rename on the host */
+                sf_handle_invalidate(sf_g, sf_file_i);
+                if (new_dentry->d_inode)
+                    sf_handle_invalidate(sf_g, GET_INODE_INFO(new_dentry->d_inode));
+                rc = vboxCallRename(&client_handle, &sf_g->map, old_str,
+                                    new_str, fDir ? 0 : SHFL_RENAME_FILE | SHFL_RENAME_REPLACE_IF_EXISTS);
+                if (RT_SUCCESS(rc))
+                {
+                    sf_new_i->force_restat = 1;
+                    sf_old_i->force_restat = 1; /* XXX: needed? */
+                    sf_new_i->force_reread = 1;
+                    sf_old_i->force_reread = 1;
+                    sf_new_i->dir_stamp = jiffies;
+                    sf_old_i->dir_stamp = jiffies;
+                    /* Set the new parent and name of the inode. */
+                    sf_path_move(sf_file_i->path, new_path);
+                    new_path = NULL;
+                }
+                else
+                {
+                    LogFunc(("vboxCallRename failed rc=%Rrc\n", rc));
+                    err = -RTErrConvertToErrno(rc);
+                }
             }
+            sf_free_path(old_str);
+            sf_free_path(new_str);
+            if (new_path)
+                sf_path_put(new_path);
         }
     }
     return err;
@@ -811,7 +1594,8 @@ static int sf_symlink(struct inode *parent, struct dentry *dentry, const char *s
     int rc;
     struct sf_inode_info *sf_i;
     struct sf_glob_info *sf_g;
-    SHFLSTRING *path, *ssymname;
+    struct sf_path *path;
+    SHFLSTRING *str, *ssymname;
     SHFLFSOBJINFO info;
     int symname_len = strlen(symname) + 1;
 
@@ -838,7 +1622,15 @@ static int sf_symlink(struct inode *parent, struct dentry *dentry, const char *s
     ssymname->u16Size = symname_len;
     memcpy(ssymname->String.utf8, symname, symname_len);
 
-    rc = vboxCallSymlink(&client_handle, &sf_g->map, path, ssymname, &info);
+    str = sf_path_str(path);
+    if (IS_ERR(str))
+    {
+        kfree(ssymname);
+        err = PTR_ERR(str);
+        goto fail1;
+    }
+    rc = vboxCallSymlink(&client_handle, &sf_g->map, str, ssymname, &info);
+    sf_path_str_done(str);
     kfree(ssymname);
 
     if (RT_FAILURE(rc))
@@ -849,24 +1641,26 @@ static int sf_symlink(struct inode *parent, struct dentry *dentry, const char *s
             goto fail1;
         }
         LogFunc(("vboxCallSymlink(%s) failed rc=%Rrc\n",
-                    sf_i->path->String.utf8, rc));
+                    sf_i->path->name, rc));
         err = -EPROTO;
         goto fail1;
     }
 
-    err = sf_instantiate(parent, dentry, path, &info, SHFL_HANDLE_NIL);
+    err = sf_instantiate(parent, dentry, path, &info, SHFL_HANDLE_NIL, 0);
     if (err)
     {
         LogFunc(("could not instantiate dentry for %s err=%d\n",
-                 sf_i->path->String.utf8, err));
+                 sf_i->path->name, err));
         goto fail1;
     }
 
     sf_i->force_restat = 1;
+    sf_i->force_reread = 1;
+    sf_i->dir_stamp = jiffies;
     return 0;
 
 fail1:
-    kfree(path);
+    sf_path_put(path);
 fail0:
     return err;
 }
@@ -885,6 +1679,9 @@ struct inode_operations sf_dir_iops =
 #else
     .getattr    = sf_getattr,
     .setattr    = sf_setattr,
-    .symlink    = sf_symlink
+    .symlink    = sf_symlink,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
+    .atomic_open = sf_atomic_open,
 #endif
 };
@@ -20,55 +20,115 @@
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
 
-# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-static const char *sf_follow_link(struct dentry *dentry, void **cookie)
-# else
-static void *sf_follow_link(struct dentry *dentry, struct nameidata *nd)
-# endif
+/*
+ * The target of a symlink is kept in page 0 of its page cache, terminated
+ * by a NUL byte (not by i_size, which hosts don't always set to the length
+ * of the target).  It is read from the host on first use and dropped by
+ * sf_inode_refresh() like the pages of a file when the symlink changed on
+ * the host.
+ */
+static int sf_lnk_readpage(struct file *file, struct page *page)
 {
-    struct inode *inode = dentry->d_inode;
+    struct inode *inode = page->mapping->host;
     struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
     struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
-    int error = -ENOMEM;
-    char *path = (char*)get_zeroed_page(GFP_KERNEL);
+    SHFLSTRING *str;
+    char *target;
+    int err = 0;
     int rc;
 
-    if (path)
+    TRACE();
+    target = kmap(page);
+    memset(target, 0, PAGE_SIZE);
+    str = sf_path_str(sf_i->path);
+    if (IS_ERR(str))
+        err = PTR_ERR(str);
+    else
     {
-        error = 0;
-        rc = vboxReadLink(&client_handle, &sf_g->map, sf_i->path, PATH_MAX, path);
+        rc = vboxReadLink(&client_handle, &sf_g->map, str, PAGE_SIZE - 1, target);
+        sf_path_str_done(str);
         if (RT_FAILURE(rc))
         {
             LogFunc(("vboxReadLink failed, caller=%s, rc=%Rrc\n", __func__, rc));
-            free_page((unsigned long)path);
-            error = -EPROTO;
+            err = -EPROTO;
         }
     }
-# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-    return error ? ERR_PTR(error) : (*cookie = path);
-# else
-    nd_set_link(nd, error ? ERR_PTR(error) : path);
-    return NULL;
-# endif
+    flush_dcache_page(page);
+    kunmap(page);
+    if (err)
+        SetPageError(page);
+    else
+        SetPageUptodate(page);
+    unlock_page(page);
+    return err;
 }
 
-# if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
-static void sf_put_link(struct dentry *dentry, struct nameidata *nd, void *cookie)
+struct address_space_operations sf_lnk_aops =
 {
-    char *page = nd_get_link(nd);
-    if (!IS_ERR(page))
-        free_page((unsigned long)page);
+    .readpage = sf_lnk_readpage,
+};
+
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+static const char *sf_get_link(struct dentry *dentry, struct inode *inode,
+                               struct delayed_call *done)
+{
+    struct page *page;
+
+    if (!dentry)
+    {
+        /* RCU path walk: only if the target is cached */
+        page = find_get_page(inode->i_mapping, 0);
+        if (!page)
+            return ERR_PTR(-ECHILD);
+        if (!PageUptodate(page))
+        {
+            put_page(page);
+            return ERR_PTR(-ECHILD);
+        }
+    }
+    else
+    {
+        page = read_mapping_page(inode->i_mapping, 0, NULL);
+        if (IS_ERR(page))
+            return ERR_CAST(page);
+    }
+    set_delayed_call(done, page_put_link, page);
+    /* sf_init_inode() keeps symlink pages out of highmem */
+    return page_address(page);
 }
-#endif
+# elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+static const char *sf_follow_link(struct dentry *dentry, void **cookie)
+{
+    struct page *page = read_mapping_page(dentry->d_inode->i_mapping, 0, NULL);
+
+    if (IS_ERR(page))
+        return ERR_CAST(page);
+    *cookie = page;
+    return kmap(page);
+}
+# else
+static void *sf_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+    struct page *page = read_mapping_page(dentry->d_inode->i_mapping, 0, NULL);
+
+    if (IS_ERR(page))
+    {
+        nd_set_link(nd, ERR_CAST(page));
+        return NULL;
+    }
+    nd_set_link(nd, kmap(page));
+    return page;
+}
+# endif
 
 struct inode_operations sf_lnk_iops =
 {
     .readlink       = generic_readlink,
-    .follow_link    = sf_follow_link,
-# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-    .put_link       = free_page_put_link,
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+    .get_link       = sf_get_link,
 # else
-    .put_link       = sf_put_link
+    .follow_link    = sf_follow_link,
+    .put_link       = page_put_link,
 # endif
 };
 
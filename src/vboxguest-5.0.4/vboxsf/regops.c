@@ -21,37 +21,241 @@
 
 #include "vfsmod.h"
 
-static void *alloc_bounce_buffer(size_t *tmp_sizep, PRTCCPHYS physp, size_t
-                                 xfer_size, const char *caller)
+/*
+ * Bounce buffers for the host calls of the read/write paths.  Each CPU
+ * online at module load gets a pool of up to bounce_count preallocated,
+ * physically contiguous buffers of bounce_size bytes, as many as could be
+ * allocated.  A buffer goes back to the pool of the CPU it was taken from.
+ * When the pool is empty (or there is none) a buffer is kmalloc'ed as
+ * before and counted as a miss.
+ */
+struct sf_bounce_pool
+{
+    spinlock_t lock;
+    /* free buffers (sf_bounce_buf::entry) */
+    struct list_head free;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct sf_bounce_buf
+{
+    struct list_head entry;
+    /* the pool the buffer belongs to, NULL if allocated on a miss */
+    struct sf_bounce_pool *pool;
+    void *buf;
+    RTCCPHYS phys;
+    size_t size;
+};
+
+#define SF_BOUNCE_SIZE_DEFAULT (64*_1K)
+#define SF_BOUNCE_SIZE_MAX     (1*_1M)
+#define SF_BOUNCE_COUNT_DEFAULT 2
+
+static struct sf_bounce_pool __percpu *sf_bounce_pools;
+
+static int bounce_size = SF_BOUNCE_SIZE_DEFAULT;
+module_param(bounce_size, int, 0444);
+MODULE_PARM_DESC(bounce_size, "Size of the preallocated bounce buffers in bytes");
+
+static int bounce_count = SF_BOUNCE_COUNT_DEFAULT;
+module_param(bounce_count, int, 0444);
+MODULE_PARM_DESC(bounce_count, "Number of preallocated bounce buffers per CPU");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+/* sum of the per-CPU counter at offset kp->arg of struct sf_bounce_pool */
+static int sf_bounce_stat_get(char *buffer, const struct kernel_param *kp)
+{
+    size_t off = (size_t)kp->arg;
+    unsigned long sum = 0;
+    int cpu;
+
+    if (sf_bounce_pools)
+        for_each_possible_cpu(cpu)
+            sum += *(unsigned long *)((char *)per_cpu_ptr(sf_bounce_pools, cpu) + off);
+    return sprintf(buffer, "%lu", sum);
+}
+
+static const struct kernel_param_ops sf_bounce_stat_ops =
+{
+    .get = sf_bounce_stat_get,
+};
+
+module_param_cb(bounce_hits, &sf_bounce_stat_ops,
+                (void *)offsetof(struct sf_bounce_pool, hits), 0444);
+MODULE_PARM_DESC(bounce_hits, "Transfers which got a preallocated bounce buffer");
+module_param_cb(bounce_misses, &sf_bounce_stat_ops,
+                (void *)offsetof(struct sf_bounce_pool, misses), 0444);
+MODULE_PARM_DESC(bounce_misses, "Transfers which had to allocate a bounce buffer");
+#endif
+
+/* allocate a bounce buffer of [size] bytes, [size] is a multiple of PAGE_SIZE */
+static struct sf_bounce_buf *sf_bounce_buf_alloc(size_t size, gfp_t gfp)
+{
+    struct sf_bounce_buf *b;
+
+    b = kmalloc(sizeof(*b), gfp);
+    if (!b)
+        return NULL;
+    b->buf = kmalloc(size, gfp);
+    if (!b->buf)
+    {
+        kfree(b);
+        return NULL;
+    }
+    b->pool = NULL;
+    b->size = size;
+    b->phys = virt_to_phys(b->buf);
+    return b;
+}
+
+static void sf_bounce_buf_free(struct sf_bounce_buf *b)
+{
+    kfree(b->buf);
+    kfree(b);
+}
+
+/**
+ * Get a bounce buffer for a transfer of [xfer_size] bytes, from the pool of
+ * the current CPU if possible.  The buffer may be smaller than [xfer_size].
+ *
+ * @returns the buffer, NULL if out of memory
+ */
+static struct sf_bounce_buf *alloc_bounce_buffer(size_t xfer_size, const char *caller)
 {
+    struct sf_bounce_pool *pool;
+    struct sf_bounce_buf *b = NULL;
     size_t tmp_size;
-    void *tmp;
+
+    if (sf_bounce_pools)
+    {
+        pool = per_cpu_ptr(sf_bounce_pools, raw_smp_processor_id());
+        spin_lock(&pool->lock);
+        if (!list_empty(&pool->free))
+        {
+            b = list_first_entry(&pool->free, struct sf_bounce_buf, entry);
+            list_del(&b->entry);
+            pool->hits++;
+        }
+        else
+            pool->misses++;
+        spin_unlock(&pool->lock);
+        if (b)
+            return b;
+    }
 
     /* try for big first. */
     tmp_size = RT_ALIGN_Z(xfer_size, PAGE_SIZE);
     if (tmp_size > 16U*_1K)
         tmp_size = 16U*_1K;
-    tmp = kmalloc(tmp_size, GFP_KERNEL);
-    if (!tmp)
+    b = sf_bounce_buf_alloc(tmp_size, GFP_KERNEL);
+    if (!b)
     {
         /* fall back on a page sized buffer. */
-        tmp = kmalloc(PAGE_SIZE, GFP_KERNEL);
-        if (!tmp)
+        b = sf_bounce_buf_alloc(PAGE_SIZE, GFP_KERNEL);
+        if (!b)
         {
-            LogRel(("%s: could not allocate bounce buffer for xfer_size=%zu %s\n", caller, xfer_size));
+            LogRel(("%s: could not allocate bounce buffer for xfer_size=%zu\n", caller, xfer_size));
             return NULL;
         }
-        tmp_size = PAGE_SIZE;
     }
+    return b;
+}
+
+static void free_bounce_buffer(struct sf_bounce_buf *b)
+{
+    struct sf_bounce_pool *pool = b->pool;
+
+    if (!pool)
+    {
+        sf_bounce_buf_free(b);
+        return;
+    }
+
+    spin_lock(&pool->lock);
+    list_add(&b->entry, &pool->free);
+    spin_unlock(&pool->lock);
+}
+
+/**
+ * Preallocate the bounce buffer pools, see bounce_size and bounce_count.
+ * Running short of memory only leaves the pools smaller (or without any),
+ * the transfers then allocate their buffers as they go.
+ */
+void sf_bounce_init(void)
+{
+    size_t size;
+    int cpu, i, count = 0;
+
+    size = RT_ALIGN_Z(RT_CLAMP(bounce_size, (int)PAGE_SIZE, SF_BOUNCE_SIZE_MAX), PAGE_SIZE);
+    if (bounce_count < 0)
+        bounce_count = 0;
+    bounce_size = size;
+
+    sf_bounce_pools = alloc_percpu(struct sf_bounce_pool);
+    if (!sf_bounce_pools)
+    {
+        LogRelFunc(("could not allocate bounce buffer pools\n"));
+        return;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct sf_bounce_pool *pool = per_cpu_ptr(sf_bounce_pools, cpu);
+
+        spin_lock_init(&pool->lock);
+        INIT_LIST_HEAD(&pool->free);
+        pool->hits = 0;
+        pool->misses = 0;
+    }
+
+    get_online_cpus();
+    for_each_online_cpu(cpu)
+    {
+        struct sf_bounce_pool *pool = per_cpu_ptr(sf_bounce_pools, cpu);
 
-    *tmp_sizep = tmp_size;
-    *physp = virt_to_phys(tmp);
-    return tmp;
+        for (i = 0; i < bounce_count; i++)
+        {
+            struct sf_bounce_buf *b;
+
+            /* don't push the system for buffers which are only nice to have */
+            b = sf_bounce_buf_alloc(size, GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+            if (!b)
+                goto out;
+            b->pool = pool;
+            list_add(&b->entry, &pool->free);
+            count++;
+        }
+    }
+out:
+    put_online_cpus();
+    if (count < bounce_count * (int)num_online_cpus())
+        LogRelFunc(("preallocated only %d of %d bounce buffers\n",
+                    count, bounce_count * (int)num_online_cpus()));
 }
 
-static void free_bounce_buffer(void *tmp)
+void sf_bounce_done(void)
 {
-    kfree (tmp);
+    int cpu;
+
+    if (!sf_bounce_pools)
+        return;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct sf_bounce_pool *pool = per_cpu_ptr(sf_bounce_pools, cpu);
+
+        while (!list_empty(&pool->free))
+        {
+            struct sf_bounce_buf *b = list_first_entry(&pool->free,
+                                                       struct sf_bounce_buf, entry);
+
+            list_del(&b->entry);
+            sf_bounce_buf_free(b);
+        }
+    }
+    free_percpu(sf_bounce_pools);
+    sf_bounce_pools = NULL;
 }
 
 
@@ -74,13 +278,13 @@ static int sf_reg_read_aux(const char *caller, struct sf_glob_info *sf_g,
 }
 
 static int sf_reg_write_aux(const char *caller, struct sf_glob_info *sf_g,
-                            struct sf_reg_info *sf_r, void *buf,
+                            SHFLHANDLE handle, void *buf,
                             uint32_t *nwritten, uint64_t pos)
 {
     /** @todo bird: yes, kmap() and kmalloc() input only. Since the buffer is
      *        contiguous in physical memory (kmalloc or single page), we should
      *        use a physical address here to speed things up. */
-    int rc = vboxCallWrite(&client_handle, &sf_g->map, sf_r->handle,
+    int rc = vboxCallWrite(&client_handle, &sf_g->map, handle,
                            pos, nwritten, buf, false /* already locked? */);
     if (RT_FAILURE(rc))
     {
@@ -91,10 +295,81 @@ static int sf_reg_write_aux(const char *caller, struct sf_glob_info *sf_g,
     return 0;
 }
 
+/* start the write-back of the mount now instead of when it is due */
+static void sf_dirty_work_now(struct sf_glob_info *sf_g)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
+    mod_delayed_work(system_wq, &sf_g->dirty_work, 0);
+#else
+    cancel_delayed_work(&sf_g->dirty_work);
+    queue_delayed_work(system_wq, &sf_g->dirty_work, 0);
+#endif
+}
+
+/**
+ * Account a page of [inode] which just became dirty and put the inode on
+ * the dirty list of the mount, from where sf_dirty_work() writes it back
+ * once it expires or the mount's dirty limit is exceeded.  Write-back
+ * mode only.
+ */
+static void sf_page_dirtied(struct inode *inode)
+{
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+    long dirty;
+
+    spin_lock(&sf_g->dirty_lock);
+    if (list_empty(&sf_i->dirty_entry))
+    {
+        sf_i->dirtied_when = jiffies;
+        sf_i->inode = inode;
+        list_add_tail(&sf_i->dirty_entry, &sf_g->dirty_inodes);
+    }
+    spin_unlock(&sf_g->dirty_lock);
+
+    dirty = atomic_long_inc_return(&sf_g->dirty_pages);
+    if (dirty > sf_g->dirty_limit)
+        sf_dirty_work_now(sf_g);
+    else
+        queue_delayed_work(system_wq, &sf_g->dirty_work, sf_g->dirty_expire);
+}
+
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
 
 #include <linux/nfs_fs.h>
+
+/**
+ * Adapt the readahead window of [file] to the access pattern: double it
+ * (up to the mount maximum) while reads are sequential, halve it on
+ * random access.
+ *
+ * @param file          the file
+ * @param pos           file position of the read
+ * @param count         number of bytes to be read
+ */
+static void sf_reg_ra_adapt(struct file *file, loff_t pos, size_t count)
+{
+    struct sf_reg_info *sf_r = file->private_data;
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(GET_F_DENTRY(file)->d_inode->i_sb);
+    unsigned max_pages = sf_g->ra >> PAGE_SHIFT;
+    unsigned ra_pages = file->f_ra.ra_pages;
+
+    if (pos == sf_r->ra_next)
+    {
+        ra_pages *= 2;
+        if (ra_pages > max_pages)
+            ra_pages = max_pages;
+    }
+    else
+        ra_pages /= 2;
+    if (ra_pages < SF_RA_MIN_PAGES)
+        ra_pages = SF_RA_MIN_PAGES;
+
+    file->f_ra.ra_pages = ra_pages;
+    sf_r->ra_next = pos + count;
+}
+
 static ssize_t
 sf_file_read(struct kiocb *iocb, struct iov_iter *iov)
 {
@@ -105,6 +380,7 @@ sf_file_read(struct kiocb *iocb, struct iov_iter *iov)
    err = sf_inode_revalidate(dentry);
    if (err)
        return err;
+   sf_reg_ra_adapt(iocb->ki_filp, iocb->ki_pos, iov_iter_count(iov));
    return generic_file_read_iter(iocb, iov);
 }
 
@@ -125,6 +401,7 @@ sf_file_write(struct kiocb *iocb, struct iov_iter *iov)
    struct file *file = iocb->ki_filp;
    struct dentry *dentry = file->f_path.dentry;
    struct inode *inode = dentry->d_inode;
+   struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
 
    err = sf_inode_revalidate(dentry);
    if (err)
@@ -132,6 +409,15 @@ sf_file_write(struct kiocb *iocb, struct iov_iter *iov)
 
    result = generic_file_write_iter(iocb, iov);
 
+   /* over the dirty limit of the mount: the writer pays for the write-back */
+   if (   result > 0
+       && sf_g->writeback
+       && atomic_long_read(&sf_g->dirty_pages) > sf_g->dirty_limit)
+   {
+      filemap_fdatawrite(inode->i_mapping);
+      sf_dirty_work_now(sf_g);
+   }
+
    if (result >= 0 && sf_need_sync_write(file, inode)) {
       err = vfs_fsync(file, 0);
       if (err < 0) {
@@ -154,8 +440,8 @@ sf_file_write(struct kiocb *iocb, struct iov_iter *iov)
 static ssize_t sf_reg_read(struct file *file, char *buf, size_t size, loff_t *off)
 {
     int err;
+    struct sf_bounce_buf *b;
     void *tmp;
-    RTCCPHYS tmp_phys;
     size_t tmp_size;
     size_t left = size;
     ssize_t total_bytes_read = 0;
@@ -176,9 +462,11 @@ static ssize_t sf_reg_read(struct file *file, char *buf, size_t size, loff_t *of
     if (!size)
         return 0;
 
-    tmp = alloc_bounce_buffer(&tmp_size, &tmp_phys, size, __PRETTY_FUNCTION__);
-    if (!tmp)
+    b = alloc_bounce_buffer(size, __PRETTY_FUNCTION__);
+    if (!b)
         return -ENOMEM;
+    tmp = b->buf;
+    tmp_size = b->size;
 
     while (left)
     {
@@ -209,11 +497,11 @@ static ssize_t sf_reg_read(struct file *file, char *buf, size_t size, loff_t *of
     }
 
     *off += total_bytes_read;
-    free_bounce_buffer(tmp);
+    free_bounce_buffer(b);
     return total_bytes_read;
 
 fail:
-    free_bounce_buffer(tmp);
+    free_bounce_buffer(b);
     return err;
 }
 
@@ -229,8 +517,8 @@ fail:
 static ssize_t sf_reg_write(struct file *file, const char *buf, size_t size, loff_t *off)
 {
     int err;
+    struct sf_bounce_buf *b;
     void *tmp;
-    RTCCPHYS tmp_phys;
     size_t tmp_size;
     size_t left = size;
     ssize_t total_bytes_written = 0;
@@ -263,9 +551,11 @@ static ssize_t sf_reg_write(struct file *file, const char *buf, size_t size, lof
     if (!size)
         return 0;
 
-    tmp = alloc_bounce_buffer(&tmp_size, &tmp_phys, size, __PRETTY_FUNCTION__);
-    if (!tmp)
+    b = alloc_bounce_buffer(size, __PRETTY_FUNCTION__);
+    if (!b)
         return -ENOMEM;
+    tmp = b->buf;
+    tmp_size = b->size;
 
     while (left)
     {
@@ -287,12 +577,12 @@ static ssize_t sf_reg_write(struct file *file, const char *buf, size_t size, lof
         if (VbglR0CanUsePhysPageList())
         {
             err = VbglR0SfWritePhysCont(&client_handle, &sf_g->map, sf_r->handle,
-                                        pos, &nwritten, tmp_phys);
+                                        pos, &nwritten, b->phys);
             err = RT_FAILURE(err) ? -EPROTO : 0;
         }
         else
 #endif
-            err = sf_reg_write_aux(__func__, sf_g, sf_r, tmp, &nwritten, pos);
+            err = sf_reg_write_aux(__func__, sf_g, sf_r->handle, tmp, &nwritten, pos);
         if (err)
             goto fail;
 
@@ -309,11 +599,11 @@ static ssize_t sf_reg_write(struct file *file, const char *buf, size_t size, lof
         inode->i_size = *off;
 
     sf_i->force_restat = 1;
-    free_bounce_buffer(tmp);
+    free_bounce_buffer(b);
     return total_bytes_written;
 
 fail:
-    free_bounce_buffer(tmp);
+    free_bounce_buffer(b);
     return err;
 }
 #endif /* KERNEL_VERSION >= 3.16.0 */
@@ -324,6 +614,10 @@ sf_file_llseek(struct file *file, loff_t offset, int origin)
    int err;
    struct dentry *dentry;
 
+   /* only seeking relative to the end depends on the attributes */
+   if (origin == SEEK_SET || origin == SEEK_CUR)
+       return generic_file_llseek(file, offset, origin);
+
    dentry = file->f_path.dentry;
    err = sf_inode_revalidate(dentry);
    if (err)
@@ -346,6 +640,40 @@ sf_file_splice_read(struct file *file, loff_t *offset, struct pipe_inode_info *p
 }
 # endif
 
+/**
+ * Translate the access mode and O_APPEND of the open flags [f_flags] to
+ * SHFL_CF_ACCESS_* flags.
+ */
+uint32_t sf_access_flags(unsigned f_flags)
+{
+    uint32_t fFlags = 0;
+
+    switch (f_flags & O_ACCMODE)
+    {
+        case O_RDONLY:
+            fFlags |= SHFL_CF_ACCESS_READ;
+            break;
+
+        case O_WRONLY:
+            fFlags |= SHFL_CF_ACCESS_WRITE;
+            break;
+
+        case O_RDWR:
+            fFlags |= SHFL_CF_ACCESS_READWRITE;
+            break;
+
+        default:
+            BUG ();
+    }
+
+    if (f_flags & O_APPEND)
+    {
+        LogFunc(("O_APPEND set\n"));
+        fFlags |= SHFL_CF_ACCESS_APPEND;
+    }
+    return fFlags;
+}
+
 /**
  * Open a regular file.
  *
@@ -360,35 +688,68 @@ static int sf_reg_open(struct inode *inode, struct file *file)
     struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
     struct sf_reg_info *sf_r;
     SHFLCREATEPARMS params;
+    SHFLSTRING *path;
+    SHFLHANDLE handle;
+    uint32_t fFlags;
+    uint32_t fAccess = sf_access_flags(file->f_flags);
+    uint32_t fMask = SHFL_CF_ACCESS_MASK_RW | SHFL_CF_ACCESS_APPEND;
 
     TRACE();
     BUG_ON(!sf_g);
     BUG_ON(!sf_i);
 
-    LogFunc(("open %s\n", sf_i->path->String.utf8));
+    LogFunc(("open %s\n", sf_i->path->name));
 
-    sf_r = kmalloc(sizeof(*sf_r), GFP_KERNEL);
+    sf_r = sf_reg_info_alloc();
     if (!sf_r)
     {
         LogRelFunc(("could not allocate reg info\n"));
         return -ENOMEM;
     }
 
-    /* Already open? */
-    if (sf_i->handle != SHFL_HANDLE_NIL)
+    /* start with a moderate readahead window, sf_reg_ra_adapt() grows it */
+    sf_r->ra_next = 0;
+    file->f_ra.ra_pages = min_t(unsigned, SF_RA_INIT_PAGES, sf_g->ra >> PAGE_SHIFT);
+
+    /* Already open?  Only one of concurrent opens gets the handle. */
+    spin_lock(&sf_i->handle_lock);
+    handle = sf_i->handle;
+    fFlags = sf_i->handle_flags;
+    sf_i->handle = SHFL_HANDLE_NIL;
+    spin_unlock(&sf_i->handle_lock);
+
+    if (   handle != SHFL_HANDLE_NIL
+        && (   (fFlags & fMask) == fAccess
+            || (fFlags & fMask) == SHFL_CF_ACCESS_READWRITE))
     {
         /*
-         * This inode was created with sf_create_aux(). Check the CreateFlags:
-         * O_CREAT, O_TRUNC: inherent true (file was just created). Not sure
-         * about the access flags (SHFL_CF_ACCESS_*).
+         * This inode was created with sf_create_aux() or opened by
+         * sf_atomic_open() with at least the access we need. O_CREAT,
+         * O_TRUNC: inherent true (file was just created) or done by the
+         * VFS after the open.
          */
         sf_i->force_restat = 1;
-        sf_r->handle = sf_i->handle;
-        sf_i->handle = SHFL_HANDLE_NIL;
-        sf_i->file = file;
+        sf_r->sf_h = sf_handle_add(sf_i, handle, fFlags);
+        if (!sf_r->sf_h)
+        {
+            rc = vboxCallClose(&client_handle, &sf_g->map, handle);
+            if (RT_FAILURE(rc))
+                LogFunc(("vboxCallClose failed rc=%Rrc\n", rc));
+            sf_reg_info_free(sf_r);
+            return -ENOMEM;
+        }
+        sf_r->handle = handle;
         file->private_data = sf_r;
         return 0;
     }
+    if (handle != SHFL_HANDLE_NIL)
+    {
+        /* left by a create or open of another name of the same host
+           object with different access, no later open takes it either */
+        rc = vboxCallClose(&client_handle, &sf_g->map, handle);
+        if (RT_FAILURE(rc))
+            LogFunc(("vboxCallClose failed rc=%Rrc\n", rc));
+    }
 
     RT_ZERO(params);
     params.Handle = SHFL_HANDLE_NIL;
@@ -426,41 +787,39 @@ static int sf_reg_open(struct inode *inode, struct file *file)
     }
 
     if (!(params.CreateFlags & SHFL_CF_ACCESS_READWRITE))
+        params.CreateFlags |= fAccess & SHFL_CF_ACCESS_MASK_RW;
+    params.CreateFlags |= fAccess & SHFL_CF_ACCESS_APPEND;
+
+    /* Share a handle with the same access which is open or still cached
+     * from an earlier open, unless the host has to create or truncate. */
+    if (!(file->f_flags & (O_CREAT | O_TRUNC)))
     {
-        switch (file->f_flags & O_ACCMODE)
+        sf_r->sf_h = sf_handle_find(sf_g, sf_i, params.CreateFlags & fMask, fMask);
+        if (sf_r->sf_h)
         {
-            case O_RDONLY:
-                params.CreateFlags |= SHFL_CF_ACCESS_READ;
-                break;
-
-            case O_WRONLY:
-                params.CreateFlags |= SHFL_CF_ACCESS_WRITE;
-                break;
-
-            case O_RDWR:
-                params.CreateFlags |= SHFL_CF_ACCESS_READWRITE;
-                break;
-
-            default:
-                BUG ();
+            LogFunc(("reusing handle for %s\n", sf_i->path->name));
+            sf_r->handle = sf_r->sf_h->handle;
+            file->private_data = sf_r;
+            return 0;
         }
     }
 
-    if (file->f_flags & O_APPEND)
+    params.Info.Attr.fMode = inode->i_mode;
+    path = sf_path_str(sf_i->path);
+    if (IS_ERR(path))
     {
-        LogFunc(("O_APPEND set\n"));
-        params.CreateFlags |= SHFL_CF_ACCESS_APPEND;
+        sf_reg_info_free(sf_r);
+        return PTR_ERR(path);
     }
-
-    params.Info.Attr.fMode = inode->i_mode;
     LogFunc(("sf_reg_open: calling vboxCallCreate, file %s, flags=%#x, %#x\n",
-              sf_i->path->String.utf8 , file->f_flags, params.CreateFlags));
-    rc = vboxCallCreate(&client_handle, &sf_g->map, sf_i->path, &params);
+              path->String.utf8 , file->f_flags, params.CreateFlags));
+    rc = vboxCallCreate(&client_handle, &sf_g->map, path, &params);
+    sf_path_str_done(path);
     if (RT_FAILURE(rc))
     {
         LogFunc(("vboxCallCreate failed flags=%d,%#x rc=%Rrc\n",
                   file->f_flags, params.CreateFlags, rc));
-        kfree(sf_r);
+        sf_reg_info_free(sf_r);
         return -RTErrConvertToErrno(rc);
     }
 
@@ -476,15 +835,25 @@ static int sf_reg_open(struct inode *inode, struct file *file)
                 rc_linux = -EEXIST;
                 break;
             default:
+                rc_linux = -EPROTO;
                 break;
         }
+        sf_reg_info_free(sf_r);
+        return rc_linux;
+    }
+
+    sf_r->sf_h = sf_handle_add(sf_i, params.Handle, params.CreateFlags);
+    if (!sf_r->sf_h)
+    {
+        vboxCallClose(&client_handle, &sf_g->map, params.Handle);
+        sf_reg_info_free(sf_r);
+        return -ENOMEM;
     }
 
     sf_i->force_restat = 1;
     sf_r->handle = params.Handle;
-    sf_i->file = file;
     file->private_data = sf_r;
-    return rc_linux;
+    return 0;
 }
 
 /**
@@ -496,7 +865,6 @@ static int sf_reg_open(struct inode *inode, struct file *file)
  */
 static int sf_reg_release(struct inode *inode, struct file *file)
 {
-    int rc;
     struct sf_reg_info *sf_r;
     struct sf_glob_info *sf_g;
     struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
@@ -518,26 +886,126 @@ static int sf_reg_release(struct inode *inode, struct file *file)
         && filemap_fdatawrite(inode->i_mapping) != -EIO)
         filemap_fdatawait(inode->i_mapping);
 #endif
-    rc = vboxCallClose(&client_handle, &sf_g->map, sf_r->handle);
-    if (RT_FAILURE(rc))
-        LogFunc(("vboxCallClose failed rc=%Rrc\n", rc));
+    /* write-back may still hold a reference to the host handle */
+    sf_handle_release(sf_g, sf_i, sf_r->sf_h);
 
-    kfree(sf_r);
-    sf_i->file = NULL;
-    sf_i->handle = SHFL_HANDLE_NIL;
+    sf_reg_info_free(sf_r);
     file->private_data = NULL;
     return 0;
 }
 
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 25)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+/**
+ * Ask the host to flush the file of [sf_i] to stable storage, group commit
+ * style: callers arriving while a flush is in progress wait for it and are
+ * then all covered by the single next flush.
+ *
+ * @param sf_g          global information
+ * @param sf_i          inode information
+ * @param handle        host handle of the file
+ * @returns 0 on success, Linux error code otherwise
+ */
+static int sf_reg_flush_host(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                             SHFLHANDLE handle)
+{
+    unsigned long want;
+    int rc, err;
+
+    /* the flush in progress may have started before our data was written,
+       we need the next one */
+    spin_lock(&sf_i->flush_lock);
+    want = sf_i->flush_started + 1;
+    spin_unlock(&sf_i->flush_lock);
+
+    mutex_lock(&sf_i->flush_mutex);
+    spin_lock(&sf_i->flush_lock);
+    if ((long)(sf_i->flush_done - want) >= 0)
+    {
+        /* somebody else did it for us */
+        err = sf_i->flush_err;
+        spin_unlock(&sf_i->flush_lock);
+        mutex_unlock(&sf_i->flush_mutex);
+        return err;
+    }
+    want = ++sf_i->flush_started;
+    spin_unlock(&sf_i->flush_lock);
+
+    rc = vboxCallFlush(&client_handle, &sf_g->map, handle);
+    err = 0;
+    if (RT_FAILURE(rc))
+    {
+        LogFunc(("vboxCallFlush failed rc=%Rrc\n", rc));
+        err = -RTErrConvertToErrno(rc);
+    }
+
+    spin_lock(&sf_i->flush_lock);
+    sf_i->flush_done = want;
+    sf_i->flush_err = err;
+    spin_unlock(&sf_i->flush_lock);
+    mutex_unlock(&sf_i->flush_mutex);
+    return err;
+}
+
+static struct sf_handle *sf_reg_wb_handle(struct inode *inode);
+
+/**
+ * fsync/fdatasync: write back the dirty pages of the range, then have the
+ * host flush the file through a handle with write access, the one of
+ * [file] may be read-only.
+ */
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+static int sf_reg_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+# else
+static int sf_reg_fsync(struct file *file, int datasync)
+# endif
+{
+    struct inode *inode = GET_F_DENTRY(file)->d_inode;
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+    struct sf_handle *sf_h;
+    int dirty, err;
+
+    TRACE();
+
+    dirty =    mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY)
+            || mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK);
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+    err = filemap_write_and_wait_range(inode->i_mapping, start, end);
+# else
+    err = filemap_write_and_wait(inode->i_mapping);
+# endif
+    if (err)
+        return err;
+
+    /* without an open or cached write handle and without dirty pages
+       there is nothing of ours to flush */
+    sf_h = sf_handle_find(sf_g, sf_i, SHFL_CF_ACCESS_WRITE, SHFL_CF_ACCESS_WRITE);
+    if (!sf_h)
+    {
+        if (!dirty)
+            return 0;
+        /* write-back closed its handle already (handle_ttl=0) */
+        sf_h = sf_reg_wb_handle(inode);
+        if (!sf_h)
+            return -EIO;
+    }
+
+    err = sf_reg_flush_host(sf_g, sf_i, sf_h->handle);
+    sf_handle_release(sf_g, sf_i, sf_h);
+    return err;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31)
+# if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 25)
 static int sf_reg_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+# elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
 static struct page *sf_reg_nopage(struct vm_area_struct *vma, unsigned long vaddr, int *type)
-# define SET_TYPE(t) *type = (t)
-#else /* LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0) */
+#  define SET_TYPE(t) *type = (t)
+# else /* LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0) */
 static struct page *sf_reg_nopage(struct vm_area_struct *vma, unsigned long vaddr, int unused)
-# define SET_TYPE(t)
-#endif
+#  define SET_TYPE(t)
+# endif
 {
     struct page *page;
     char *buf;
@@ -621,21 +1089,68 @@ static struct page *sf_reg_nopage(struct vm_area_struct *vma, unsigned long vadd
 
 static struct vm_operations_struct sf_vma_ops =
 {
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 25)
+# if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 25)
     .fault = sf_reg_fault
-#else
+# else
      .nopage = sf_reg_nopage
-#endif
+# endif
 };
 
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31) */
+
+/**
+ * A page of a shared mapping is about to be written to: dirty it so that
+ * the write-back path sends it to the host.
+ */
+static int sf_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct page *page = vmf->page;
+    struct inode *inode = GET_F_DENTRY(vma->vm_file)->d_inode;
+
+    TRACE();
+
+    file_update_time(vma->vm_file);
+    lock_page(page);
+    if (   page->mapping != inode->i_mapping
+        || page_offset(page) >= i_size_read(inode))
+    {
+        /* truncated meanwhile */
+        unlock_page(page);
+        return VM_FAULT_NOPAGE;
+    }
+
+    set_page_dirty(page);
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+    wait_for_stable_page(page);
+# endif
+    return VM_FAULT_LOCKED;
+}
+
+/* private and shared mappings are both backed by the page cache, faults
+   are read through sf_readpage()/sf_readpages() and already cached
+   neighbours of a faulting page are mapped along with it */
+static struct vm_operations_struct sf_vma_ops =
+{
+    .fault        = filemap_fault,
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+    .map_pages    = filemap_map_pages,
+# endif
+    .page_mkwrite = sf_page_mkwrite,
+};
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31) */
+
 static int sf_reg_mmap(struct file *file, struct vm_area_struct *vma)
 {
     TRACE();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+    file_accessed(file);
+#else
     if (vma->vm_flags & VM_SHARED)
     {
         LogFunc(("shared mmapping not available\n"));
         return -EINVAL;
     }
+#endif
 
     vma->vm_ops = &sf_vma_ops;
     return 0;
@@ -664,7 +1179,7 @@ struct file_operations sf_reg_fops =
     .sendfile    = generic_file_sendfile,
 # endif
 # if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
-    .fsync       = noop_fsync,
+    .fsync       = sf_reg_fsync,
 # else
     .fsync       = simple_sync_file,
 # endif
@@ -715,10 +1230,14 @@ static int sf_readpage(struct file *file, struct page *page)
     return 0;
 }
 
-static int sf_readpages(struct file *file, struct address_space *mapping,
-                        struct list_head *pages, unsigned nr_pages)
+/**
+ * Readahead through a bounce buffer, for hosts which cannot take physical
+ * page lists.
+ */
+static int sf_readpages_bounce(struct file *file, struct address_space *mapping,
+                               struct list_head *pages, unsigned nr_pages)
 {
-    RTCCPHYS tmp_phys;
+    struct sf_bounce_buf *b;
     struct dentry *dentry = file->f_path.dentry;
     struct inode *inode = dentry->d_inode;
     struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
@@ -736,15 +1255,18 @@ static int sf_readpages(struct file *file, struct address_space *mapping,
     bufsize2 = PAGE_SIZE * (list_entry(pages->next, struct page, lru)->index
                             - list_entry(pages->prev, struct page, lru)->index);
     bufsize = PAGE_SIZE * nr_pages;
-    if (bufsize > 32 * PAGE_SIZE)
-        bufsize = 32 * PAGE_SIZE;
+    if (bufsize > sf_g->rsize)
+        bufsize = sf_g->rsize;
 
     if (!bufsize)
         return 0;
 
-    physbuf = alloc_bounce_buffer(&tmp_size, &tmp_phys, bufsize, __PRETTY_FUNCTION__);
-    if (!physbuf)
+    b = alloc_bounce_buffer(bufsize, __PRETTY_FUNCTION__);
+    if (!b)
         return -ENOMEM;
+    physbuf = b->buf;
+    /* pool buffers may be larger than the readahead */
+    tmp_size = RT_MIN(b->size, (size_t)bufsize);
 
 
     while (!list_empty(pages))
@@ -782,11 +1304,261 @@ static int sf_readpages(struct file *file, struct address_space *mapping,
         unlock_page(page);
         page_cache_release(page);
     }
-    free_bounce_buffer(physbuf);
+    free_bounce_buffer(b);
+    return err;
+}
+
+/**
+ * Read a run of consecutive page cache pages directly from the host. The
+ * physical addresses of the pages are passed as a page list so the host
+ * writes straight into the page cache without a bounce buffer.
+ *
+ * The pages are locked and referenced on entry. On return they are unlocked,
+ * released and marked up to date unless the host call failed.
+ *
+ * @param sf_g          the mount
+ * @param sf_r          the open file
+ * @param papPages      the pages, with consecutive indexes
+ * @param paPhys        scratch array for the physical addresses
+ * @param cPages        number of pages in the run
+ * @returns 0 on success, Linux error code otherwise
+ */
+static int sf_readpages_run(struct sf_glob_info *sf_g, struct sf_reg_info *sf_r,
+                            struct page **papPages, RTGCPHYS64 *paPhys,
+                            unsigned cPages)
+{
+    uint32_t nread = cPages << PAGE_SHIFT;
+    loff_t off = (loff_t)papPages[0]->index << PAGE_SHIFT;
+    unsigned i;
+    int rc;
+    int err = 0;
+
+    for (i = 0; i < cPages; i++)
+        paPhys[i] = page_to_phys(papPages[i]);
+
+    rc = VbglR0SharedFolderReadPageList(&client_handle, &sf_g->map, sf_r->handle,
+                                        off, &nread, 0, cPages, paPhys);
+    if (RT_FAILURE(rc))
+    {
+        LogFunc(("VbglR0SharedFolderReadPageList failed rc=%Rrc\n", rc));
+        err = -EPROTO;
+    }
+
+    for (i = 0; i < cPages; i++)
+    {
+        struct page *page = papPages[i];
+        uint32_t offPage = i << PAGE_SHIFT;
+
+        if (!err)
+        {
+            /* zero whatever the host did not fill (EOF) */
+            if (nread < offPage + PAGE_SIZE)
+                zero_user_segment(page, nread > offPage ? nread - offPage : 0, PAGE_SIZE);
+            flush_dcache_page(page);
+            SetPageUptodate(page);
+        }
+        else
+            SetPageError(page);
+        unlock_page(page);
+        page_cache_release(page);
+    }
+    return err;
+}
+
+/* a run of readahead pages, read synchronously or handed to sf_read_wq */
+struct sf_read_req
+{
+    struct work_struct work;
+    /* referenced while the request is queued, keeps the host handle open */
+    struct file *file;
+    unsigned cPages;
+    RTGCPHYS64 *paPhys;
+    struct page *apPages[1];
+};
+
+static struct sf_read_req *sf_read_req_alloc(struct file *file, unsigned cMaxPages)
+{
+    struct sf_read_req *req;
+
+    req = kmalloc(RT_UOFFSETOF(struct sf_read_req, apPages[cMaxPages])
+                  + cMaxPages * sizeof(RTGCPHYS64), GFP_KERNEL);
+    if (!req)
+        return NULL;
+    req->file = file;
+    req->cPages = 0;
+    req->paPhys = (RTGCPHYS64 *)&req->apPages[cMaxPages];
+    return req;
+}
+
+/* workqueue handler: do the host read of a queued request and complete
+   its pages */
+static void sf_read_req_work(struct work_struct *work)
+{
+    struct sf_read_req *req = container_of(work, struct sf_read_req, work);
+    struct inode *inode = GET_F_DENTRY(req->file)->d_inode;
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+
+    sf_readpages_run(sf_g, req->file->private_data, req->apPages, req->paPhys,
+                     req->cPages);
+    atomic_sub(req->cPages << PAGE_SHIFT, &sf_g->inflight_bytes);
+    fput(req->file);
+    kfree(req);
+}
+
+/**
+ * Issue the host read for [req] and free it. The read is queued to
+ * sf_read_wq so that several runs of one readahead window are in flight
+ * at the same time, unless that would exceed the per-mount budget of
+ * outstanding bytes. In that case the read is done synchronously.
+ *
+ * @returns 0 if queued or read successfully, Linux error code otherwise
+ */
+static int sf_read_req_submit(struct sf_glob_info *sf_g, struct sf_read_req *req)
+{
+    int cb = req->cPages << PAGE_SHIFT;
+    int err;
+
+    if (sf_read_wq)
+    {
+        if (atomic_add_return(cb, &sf_g->inflight_bytes) <= sf_g->inflight)
+        {
+            get_file(req->file);
+            INIT_WORK(&req->work, sf_read_req_work);
+            queue_work(sf_read_wq, &req->work);
+            return 0;
+        }
+        atomic_sub(cb, &sf_g->inflight_bytes);
+    }
+
+    err = sf_readpages_run(sf_g, req->file->private_data, req->apPages, req->paPhys,
+                           req->cPages);
+    kfree(req);
+    return err;
+}
+
+static int sf_readpages(struct file *file, struct address_space *mapping,
+                        struct list_head *pages, unsigned nr_pages)
+{
+    struct inode *inode = GET_F_DENTRY(file)->d_inode;
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_read_req *req = NULL;
+    unsigned cMaxPages;
+    int err = 0;
+
+    TRACE();
+
+    if (!nr_pages)
+        return 0;
+
+    if (!VbglR0CanUsePhysPageList())
+        return sf_readpages_bounce(file, mapping, pages, nr_pages);
+
+    cMaxPages = nr_pages;
+    if (cMaxPages > sf_g->rsize >> PAGE_SHIFT)
+        cMaxPages = sf_g->rsize >> PAGE_SHIFT;
+
+    /* The list is in descending index order, so take pages from the tail
+     * and issue one host read per run of consecutive indexes. */
+    while (!list_empty(pages))
+    {
+        struct page *page = list_entry(pages->prev, struct page, lru);
+        list_del(&page->lru);
+        if (add_to_page_cache_lru(page, mapping, page->index, GFP_KERNEL))
+        {
+            page_cache_release(page);
+            continue;
+        }
+
+        if (   req
+            && (   req->cPages == cMaxPages
+                || req->apPages[req->cPages - 1]->index + 1 != page->index))
+        {
+            err = sf_read_req_submit(sf_g, req);
+            req = NULL;
+            if (err)
+            {
+                unlock_page(page);
+                page_cache_release(page);
+                break;
+            }
+        }
+        if (!req)
+        {
+            req = sf_read_req_alloc(file, cMaxPages);
+            if (!req)
+            {
+                err = -ENOMEM;
+                unlock_page(page);
+                page_cache_release(page);
+                break;
+            }
+        }
+        req->apPages[req->cPages++] = page;
+    }
+
+    if (req)
+        err = sf_read_req_submit(sf_g, req);
+
     return err;
 }
 
+/**
+ * Get a host handle to write back the dirty pages of [inode] with: one with
+ * write access which an open file of the inode already has, or a new one.
+ *
+ * @param inode         the inode
+ * @returns the handle with a reference, NULL on failure
+ */
+static struct sf_handle *sf_reg_wb_handle(struct inode *inode)
+{
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+    struct sf_handle *sf_h;
+    SHFLCREATEPARMS params;
+    SHFLSTRING *path;
+    int rc;
 
+    /* the host ignores the offset for handles opened for appending */
+    sf_h = sf_handle_find(sf_g, sf_i, SHFL_CF_ACCESS_WRITE,
+                          SHFL_CF_ACCESS_WRITE | SHFL_CF_ACCESS_APPEND);
+    if (sf_h)
+        return sf_h;
+
+    RT_ZERO(params);
+    params.Handle = SHFL_HANDLE_NIL;
+    params.CreateFlags = SHFL_CF_ACT_OPEN_IF_EXISTS
+                       | SHFL_CF_ACT_FAIL_IF_NEW
+                       | SHFL_CF_ACCESS_WRITE;
+    if (sf_make_path(__func__, sf_i->path, NULL, 0, &path))
+        return NULL;
+    rc = vboxCallCreate(&client_handle, &sf_g->map, path, &params);
+    sf_free_path(path);
+    if (RT_FAILURE(rc) || params.Handle == SHFL_HANDLE_NIL)
+    {
+        LogFunc(("could not open %s for write-back rc=%Rrc\n",
+                 sf_i->path->name, rc));
+        return NULL;
+    }
+
+    sf_h = sf_handle_add(sf_i, params.Handle, params.CreateFlags);
+    if (!sf_h)
+        vboxCallClose(&client_handle, &sf_g->map, params.Handle);
+    return sf_h;
+}
+
+/**
+ * Dirty [page] again after its write-back failed.  As
+ * redirty_page_for_writepage() does not go through sf_set_page_dirty(),
+ * account it and requeue the inode here.
+ */
+static void sf_redirty_page(struct writeback_control *wbc, struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+
+    if (   redirty_page_for_writepage(wbc, page)
+        && GET_GLOB_INFO(inode->i_sb)->writeback)
+        sf_page_dirtied(inode);
+}
 
 static int
 sf_writepage(struct page *page, struct writeback_control *wbc)
@@ -795,8 +1567,7 @@ sf_writepage(struct page *page, struct writeback_control *wbc)
     struct inode *inode = mapping->host;
     struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
     struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
-    struct file *file = sf_i->file;
-    struct sf_reg_info *sf_r = file->private_data;
+    struct sf_handle *sf_h;
     char *buf;
     uint32_t nwritten = PAGE_SIZE;
     int end_index = inode->i_size >> PAGE_SHIFT;
@@ -805,12 +1576,23 @@ sf_writepage(struct page *page, struct writeback_control *wbc)
 
     TRACE();
 
+    if (sf_g->writeback)
+        atomic_long_add_unless(&sf_g->dirty_pages, -1, 0);
+
+    sf_h = sf_reg_wb_handle(inode);
+    if (!sf_h)
+    {
+        sf_redirty_page(wbc, page);
+        unlock_page(page);
+        return -EBADF;
+    }
+
     if (page->index >= end_index)
         nwritten = inode->i_size & (PAGE_SIZE-1);
 
     buf = kmap(page);
 
-    err = sf_reg_write_aux(__func__, sf_g, sf_r, buf, &nwritten, off);
+    err = sf_reg_write_aux(__func__, sf_g, sf_h->handle, buf, &nwritten, off);
     if (err < 0)
     {
         ClearPageUptodate(page);
@@ -826,6 +1608,7 @@ sf_writepage(struct page *page, struct writeback_control *wbc)
 
 out:
     kunmap(page);
+    sf_handle_release(sf_g, sf_i, sf_h);
 
     unlock_page(page);
     return err;
@@ -833,6 +1616,167 @@ out:
 
 # if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
 
+/* a run of consecutive dirty pages collected by sf_writepages() */
+struct sf_writepages_ctx
+{
+    struct sf_glob_info *sf_g;
+    struct sf_handle    *sf_h;
+    struct inode        *inode;
+    struct writeback_control *wbc;
+    struct page        **papPages;
+    RTGCPHYS64          *paPhys;
+    unsigned             cPages;
+    unsigned             cMaxPages;
+};
+
+/**
+ * Send the collected run of pages to the host with a single page list
+ * write and end writeback on them.  Pages failing with a transient error
+ * are dirtied again for the next write-back.
+ *
+ * @param ctx           the collected run
+ * @returns 0 on success, Linux error code otherwise
+ */
+static int sf_writepages_flush(struct sf_writepages_ctx *ctx)
+{
+    struct inode *inode = ctx->inode;
+    loff_t off = (loff_t)ctx->papPages[0]->index << PAGE_SHIFT;
+    loff_t i_size = i_size_read(inode);
+    uint32_t nwritten = ctx->cPages << PAGE_SHIFT;
+    unsigned i;
+    int rc;
+    int err = 0;
+
+    /* don't extend the file on the host with the tail of the last page */
+    if (off + nwritten > i_size)
+        nwritten = i_size > off ? (uint32_t)(i_size - off) : 0;
+
+    for (i = 0; i < ctx->cPages; i++)
+        ctx->paPhys[i] = page_to_phys(ctx->papPages[i]);
+
+    if (nwritten)
+    {
+        rc = VbglR0SharedFolderWritePageList(&client_handle, &ctx->sf_g->map,
+                                             ctx->sf_h->handle, off, &nwritten,
+                                             0, ctx->cPages, ctx->paPhys);
+        if (RT_FAILURE(rc))
+        {
+            LogFunc(("VbglR0SharedFolderWritePageList failed rc=%Rrc\n", rc));
+            err = -RTErrConvertToErrno(rc);
+        }
+    }
+
+    for (i = 0; i < ctx->cPages; i++)
+    {
+        struct page *page = ctx->papPages[i];
+
+        if (err == -EAGAIN || err == -EINTR || err == -ENOMEM)
+            sf_redirty_page(ctx->wbc, page);
+        else if (err)
+        {
+            SetPageError(page);
+            mapping_set_error(page->mapping, err);
+        }
+        else if (PageError(page))
+            ClearPageError(page);
+        end_page_writeback(page);
+    }
+
+    ctx->cPages = 0;
+    return err;
+}
+
+/**
+ * write_cache_pages() callback: add a dirty page to the current run,
+ * sending the run to the host first if the page does not extend it.
+ */
+static int sf_writepages_add(struct page *page, struct writeback_control *wbc, void *data)
+{
+    struct sf_writepages_ctx *ctx = data;
+    loff_t i_size = i_size_read(ctx->inode);
+    int err;
+
+    /* write_cache_pages() has just cleaned it */
+    if (ctx->sf_g->writeback)
+        atomic_long_add_unless(&ctx->sf_g->dirty_pages, -1, 0);
+
+    if (   ctx->cPages
+        && (   ctx->cPages == ctx->cMaxPages
+            || ctx->papPages[ctx->cPages - 1]->index + 1 != page->index))
+    {
+        err = sf_writepages_flush(ctx);
+        if (err)
+        {
+            sf_redirty_page(wbc, page);
+            unlock_page(page);
+            return err;
+        }
+    }
+
+    /* truncated while we were looking at it */
+    if (((loff_t)page->index << PAGE_SHIFT) >= i_size)
+    {
+        unlock_page(page);
+        return 0;
+    }
+
+    set_page_writeback(page);
+    unlock_page(page);
+    ctx->papPages[ctx->cPages++] = page;
+    return 0;
+}
+
+/**
+ * Write back dirty pages, coalescing runs of consecutive pages of up to
+ * [sf_g]->wsize bytes into one host call each.
+ */
+static int sf_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct inode *inode = mapping->host;
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+    struct sf_writepages_ctx ctx;
+    int err;
+
+    TRACE();
+
+    if (!VbglR0CanUsePhysPageList())
+        return generic_writepages(mapping, wbc);
+
+    ctx.sf_g      = GET_GLOB_INFO(inode->i_sb);
+    ctx.inode     = inode;
+    ctx.wbc       = wbc;
+    ctx.cPages    = 0;
+    ctx.cMaxPages = ctx.sf_g->wsize >> PAGE_SHIFT;
+    ctx.papPages  = kmalloc(ctx.cMaxPages * (sizeof(*ctx.papPages) + sizeof(*ctx.paPhys)),
+                            GFP_NOFS);
+    if (!ctx.papPages)
+        return generic_writepages(mapping, wbc);
+    ctx.paPhys = (RTGCPHYS64 *)&ctx.papPages[ctx.cMaxPages];
+
+    ctx.sf_h = sf_reg_wb_handle(inode);
+    if (!ctx.sf_h)
+    {
+        kfree(ctx.papPages);
+        return -EBADF;
+    }
+
+    err = write_cache_pages(mapping, wbc, sf_writepages_add, &ctx);
+    if (ctx.cPages)
+    {
+        int err2 = sf_writepages_flush(&ctx);
+        if (!err)
+            err = err2;
+    }
+
+    sf_handle_release(ctx.sf_g, sf_i, ctx.sf_h);
+    kfree(ctx.papPages);
+    return err;
+}
+
+# endif /* KERNEL_VERSION >= 2.6.24 */
+
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
+
 /*
  * Determine the number of bytes of data the page contains
  */
@@ -894,6 +1838,70 @@ start:
 }
 
 
+/**
+ * Dirty a page, in write-back mode also accounting it and queueing its
+ * inode (sf_page_dirtied()).
+ */
+static int sf_set_page_dirty(struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+
+    if (!__set_page_dirty_nobuffers(page))
+        return 0;
+
+    if (GET_GLOB_INFO(inode->i_sb)->writeback)
+        sf_page_dirtied(inode);
+    return 1;
+}
+
+/**
+ * Write back the inodes on the dirty list of a mount which are dirty for
+ * longer than dirty_expire, or all of them while the mount is over its
+ * dirty limit.
+ */
+void sf_dirty_work(struct work_struct *work)
+{
+    struct sf_glob_info *sf_g = container_of(to_delayed_work(work),
+                                             struct sf_glob_info, dirty_work);
+    struct sf_inode_info *sf_i;
+    struct inode *inode;
+
+    TRACE();
+
+    spin_lock(&sf_g->dirty_lock);
+    while (!list_empty(&sf_g->dirty_inodes))
+    {
+        sf_i = list_first_entry(&sf_g->dirty_inodes, struct sf_inode_info, dirty_entry);
+        if (   mapping_tagged(sf_i->inode->i_mapping, PAGECACHE_TAG_DIRTY)
+            && time_before(jiffies, sf_i->dirtied_when + sf_g->dirty_expire)
+            && atomic_long_read(&sf_g->dirty_pages) <= sf_g->dirty_limit)
+        {
+            /* the list is sorted, nothing else expired yet */
+            queue_delayed_work(system_wq, &sf_g->dirty_work,
+                               sf_i->dirtied_when + sf_g->dirty_expire - jiffies);
+            break;
+        }
+
+        /* sf_evict_inode() takes the inode off the list before freeing it */
+        list_del_init(&sf_i->dirty_entry);
+        if (!mapping_tagged(sf_i->inode->i_mapping, PAGECACHE_TAG_DIRTY))
+            continue;
+        inode = igrab(sf_i->inode);
+        if (!inode)
+            continue;
+        spin_unlock(&sf_g->dirty_lock);
+
+        filemap_fdatawrite(inode->i_mapping);
+        iput(inode);
+
+        spin_lock(&sf_g->dirty_lock);
+    }
+    /* pages cleaned by truncation are not accounted, resync */
+    if (list_empty(&sf_g->dirty_inodes))
+        atomic_long_set(&sf_g->dirty_pages, 0);
+    spin_unlock(&sf_g->dirty_lock);
+}
+
 int sf_write_end(struct file *file, struct address_space *mapping, loff_t pos,
                  unsigned len, unsigned copied, struct page *page, void *fsdata)
 {
@@ -902,17 +1910,12 @@ int sf_write_end(struct file *file, struct address_space *mapping, loff_t pos,
     struct sf_reg_info *sf_r = file->private_data;
     void *buf;
     unsigned from = pos & (PAGE_SIZE - 1);
-    unsigned to = from + len;
-    uint32_t nwritten = len;
+    unsigned to = from + copied;
+    uint32_t nwritten = copied;
     int err;
 
     TRACE();
 
-    buf = kmap(page);
-    err = sf_reg_write_aux(__func__, sf_g, sf_r, buf+from, &nwritten, pos);
-    kunmap(page);
-
-
     if (!PageUptodate(page)) {
         unsigned pglen = sf_page_length(page);
 
@@ -930,10 +1933,24 @@ int sf_write_end(struct file *file, struct address_space *mapping, loff_t pos,
     /* if (!PageUptodate(page) && err == PAGE_SIZE) */
     /*     SetPageUptodate(page); */
 
+    /* write-back mode: only dirty the page, sf_writepages() sends whole
+       pages to the host later so this needs a completely valid page */
+    if (sf_g->writeback && PageUptodate(page))
+    {
+        set_page_dirty(page);
+        err = 0;
+    }
+    else
+    {
+        buf = kmap(page);
+        err = sf_reg_write_aux(__func__, sf_g, sf_r->handle, buf+from, &nwritten, pos);
+        kunmap(page);
+    }
+
     if (err >= 0) {
         pos += nwritten;
         if (pos > inode->i_size)
-            inode->i_size = pos;
+            i_size_write(inode, pos);
     }
 
     unlock_page(page);
@@ -944,14 +1961,137 @@ int sf_write_end(struct file *file, struct address_space *mapping, loff_t pos,
 
 # endif /* KERNEL_VERSION >= 2.6.24 */
 
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+
+/* max number of user pages pinned and passed to the host per direct I/O call */
+#define SF_DIRECT_IO_MAX_PAGES 512
+
+/**
+ * O_DIRECT read/write. The user pages of each iov segment are pinned and
+ * handed to the host as a physical page list, without a bounce buffer
+ * and without going through the page cache.
+ *
+ * @returns number of bytes transferred, 0 to make the caller fall back to
+ *          buffered I/O, Linux error code otherwise
+ */
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static ssize_t sf_direct_IO(struct kiocb *iocb, struct iov_iter *iter, loff_t offset)
+#  else
+static ssize_t sf_direct_IO(int rw, struct kiocb *iocb, struct iov_iter *iter, loff_t offset)
+#  endif
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file->f_mapping->host;
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+    struct sf_reg_info *sf_r = file->private_data;
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+    int fWrite = iov_iter_rw(iter) == WRITE;
+#  else
+    int fWrite = (rw & WRITE) != 0;
+#  endif
+    struct page **papPages;
+    RTGCPHYS64 *paPhys;
+    ssize_t total = 0;
+
+    TRACE();
+
+    if (!VbglR0CanUsePhysPageList())
+        return 0;
+
+    papPages = kmalloc(SF_DIRECT_IO_MAX_PAGES * (sizeof(*papPages) + sizeof(*paPhys)),
+                       GFP_KERNEL);
+    if (!papPages)
+        return -ENOMEM;
+    paPhys = (RTGCPHYS64 *)&papPages[SF_DIRECT_IO_MAX_PAGES];
+
+    while (iov_iter_count(iter))
+    {
+        size_t offFirstPage;
+        ssize_t cbPinned;
+        uint32_t cb;
+        unsigned cPages, i;
+        int rc;
+
+        /* Pins at most one iov segment, limited so that the first page
+         * offset cannot push us over SF_DIRECT_IO_MAX_PAGES. */
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+        cbPinned = iov_iter_get_pages(iter, papPages,
+                                      (size_t)(SF_DIRECT_IO_MAX_PAGES - 1) << PAGE_SHIFT,
+                                      SF_DIRECT_IO_MAX_PAGES, &offFirstPage);
+#  else
+        cbPinned = iov_iter_get_pages(iter, papPages,
+                                      (size_t)(SF_DIRECT_IO_MAX_PAGES - 1) << PAGE_SHIFT,
+                                      &offFirstPage);
+#  endif
+        if (cbPinned <= 0)
+        {
+            if (!total)
+                total = cbPinned ? cbPinned : -EFAULT;
+            break;
+        }
+
+        cPages = (offFirstPage + cbPinned + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        for (i = 0; i < cPages; i++)
+            paPhys[i] = page_to_phys(papPages[i]);
+
+        cb = (uint32_t)cbPinned;
+        if (fWrite)
+            rc = VbglR0SharedFolderWritePageList(&client_handle, &sf_g->map, sf_r->handle,
+                                                 offset, &cb, (uint16_t)offFirstPage,
+                                                 (uint16_t)cPages, paPhys);
+        else
+            rc = VbglR0SharedFolderReadPageList(&client_handle, &sf_g->map, sf_r->handle,
+                                                offset, &cb, (uint16_t)offFirstPage,
+                                                (uint16_t)cPages, paPhys);
+
+        for (i = 0; i < cPages; i++)
+        {
+            if (!fWrite && RT_SUCCESS(rc))
+                set_page_dirty_lock(papPages[i]);
+            put_page(papPages[i]);
+        }
+
+        if (RT_FAILURE(rc))
+        {
+            LogFunc(("%s page list failed rc=%Rrc\n", fWrite ? "write" : "read", rc));
+            if (!total)
+                total = -EPROTO;
+            break;
+        }
+
+        iov_iter_advance(iter, cb);
+        offset += cb;
+        total  += cb;
+        if (cb != (uint32_t)cbPinned)
+            break; /* EOF or host out of space */
+    }
+
+    /* the host changed size and times behind the page cache */
+    if (fWrite && total > 0)
+        sf_i->force_restat = 1;
+
+    kfree(papPages);
+    return total;
+}
+
+# endif /* KERNEL_VERSION >= 3.16.0 */
+
 struct address_space_operations sf_reg_aops =
 {
     .readpage      = sf_readpage,
     .readpages     = sf_readpages,
     .writepage     = sf_writepage,
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
+    .writepages    = sf_writepages,
+# endif
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+    .direct_IO     = sf_direct_IO,
+# endif
 # if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
     .write_begin   = sf_write_begin,
     .write_end     = sf_write_end,
+    .set_page_dirty = sf_set_page_dirty,
 # else
     .prepare_write = simple_prepare_write,
     .commit_write  = simple_commit_write,
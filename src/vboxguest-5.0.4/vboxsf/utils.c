@@ -24,6 +24,16 @@
 
 /* #define USE_VMALLOC */
 
+/* slab caches of the fixed size objects of the lookup and open paths,
+   see sf_caches_init() */
+static struct kmem_cache *sf_inode_cachep;
+static struct kmem_cache *sf_reg_info_cachep;
+static struct kmem_cache *sf_dir_file_cachep;
+static struct kmem_cache *sf_handle_cachep;
+static struct kmem_cache *sf_path_cachep;
+static struct kmem_cache *sf_dir_info_cachep;
+static struct kmem_cache *sf_dir_buf_cachep;
+
 /*
  * sf_reg_aops and sf_backing_dev_info are just quick implementations to make
  * sendfile work. For more information have a look at
@@ -67,17 +77,12 @@ static void sf_timespec_from_ftime(RTTIMESPEC *ts, struct timespec *tv)
 }
 #endif /* >= 2.6.0 */
 
-/* set [inode] attributes based on [info], uid/gid based on [sf_g] */
-void sf_init_inode(struct sf_glob_info *sf_g, struct inode *inode,
-                   PSHFLFSOBJINFO info)
+/* permission bits for the host mode [attr], dmode/fmode and dmask/fmask
+   of [sf_g] applied */
+static int sf_attr_mode(struct sf_glob_info *sf_g, PSHFLFSOBJATTR attr)
 {
-    PSHFLFSOBJATTR attr;
     int mode;
 
-    TRACE();
-
-    attr = &info->Attr;
-
 #define mode_set(r) attr->fMode & (RTFS_UNIX_##r) ? (S_##r) : 0;
     mode  = mode_set(ISUID);
     mode |= mode_set(ISGID);
@@ -96,9 +101,37 @@ void sf_init_inode(struct sf_glob_info *sf_g, struct inode *inode,
 
 #undef mode_set
 
+    if (RTFS_IS_DIRECTORY(attr->fMode))
+    {
+        mode = sf_g->dmode != ~0 ? (sf_g->dmode & 0777) : mode;
+        mode &= ~sf_g->dmask;
+    }
+    else
+    {
+        mode = sf_g->fmode != ~0 ? (sf_g->fmode & 0777) : mode;
+        mode &= ~sf_g->fmask;
+    }
+    return mode;
+}
+
+/* set [inode] attributes based on [info], uid/gid based on [sf_g] */
+void sf_init_inode(struct sf_glob_info *sf_g, struct inode *inode,
+                   PSHFLFSOBJINFO info)
+{
+    PSHFLFSOBJATTR attr;
+    unsigned int nlink;
+
+    TRACE();
+
+    attr = &info->Attr;
+    /* only Unix hosts count the hardlinks */
+    nlink = 1;
+    if (attr->enmAdditional == RTFSOBJATTRADD_UNIX && attr->u.Unix.cHardlinks)
+        nlink = attr->u.Unix.cHardlinks;
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
     inode->i_mapping->a_ops = &sf_reg_aops;
-# if LINUX_VERSION_CODE <= KERNEL_VERSION(3, 19, 0)
+# if LINUX_VERSION_CODE < KERNEL_VERSION(4, 0, 0)
     /* XXX Was this ever necessary? */
     inode->i_mapping->backing_dev_info = &sf_g->bdi;
 # endif
@@ -106,9 +139,7 @@ void sf_init_inode(struct sf_glob_info *sf_g, struct inode *inode,
 
     if (RTFS_IS_DIRECTORY(attr->fMode))
     {
-        inode->i_mode  = sf_g->dmode != ~0 ? (sf_g->dmode & 0777) : mode;
-        inode->i_mode &= ~sf_g->dmask;
-        inode->i_mode |= S_IFDIR;
+        inode->i_mode  = sf_attr_mode(sf_g, attr) | S_IFDIR;
         inode->i_op    = &sf_dir_iops;
         inode->i_fop   = &sf_dir_fops;
         /* XXX: this probably should be set to the number of entries
@@ -122,28 +153,29 @@ void sf_init_inode(struct sf_glob_info *sf_g, struct inode *inode,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
     else if (RTFS_IS_SYMLINK(attr->fMode))
     {
-        inode->i_mode  = sf_g->fmode != ~0 ? (sf_g->fmode & 0777): mode;
-        inode->i_mode &= ~sf_g->fmask;
-        inode->i_mode |= S_IFLNK;
+        inode->i_mode  = sf_attr_mode(sf_g, attr) | S_IFLNK;
         inode->i_op    = &sf_lnk_iops;
+        /* the page cache holds the target */
+        inode->i_mapping->a_ops = &sf_lnk_aops;
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+        inode_nohighmem(inode);
+# endif
 # if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 2, 0)
-        set_nlink(inode, 1);
+        set_nlink(inode, nlink);
 # else
-        inode->i_nlink = 1;
+        inode->i_nlink = nlink;
 # endif
     }
 #endif
     else
     {
-        inode->i_mode  = sf_g->fmode != ~0 ? (sf_g->fmode & 0777): mode;
-        inode->i_mode &= ~sf_g->fmask;
-        inode->i_mode |= S_IFREG;
+        inode->i_mode  = sf_attr_mode(sf_g, attr) | S_IFREG;
         inode->i_op    = &sf_reg_iops;
         inode->i_fop   = &sf_reg_fops;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 2, 0)
-        set_nlink(inode, 1);
+        set_nlink(inode, nlink);
 #else
-        inode->i_nlink = 1;
+        inode->i_nlink = nlink;
 #endif
     }
 
@@ -171,20 +203,26 @@ void sf_init_inode(struct sf_glob_info *sf_g, struct inode *inode,
 }
 
 int sf_stat(const char *caller, struct sf_glob_info *sf_g,
-            SHFLSTRING *path, PSHFLFSOBJINFO result, int ok_to_fail)
+            struct sf_path *path, PSHFLFSOBJINFO result, int ok_to_fail)
 {
     int rc;
     SHFLCREATEPARMS params;
+    SHFLSTRING *str;
     NOREF(caller);
 
     TRACE();
 
+    str = sf_path_str(path);
+    if (IS_ERR(str))
+        return PTR_ERR(str);
+
     RT_ZERO(params);
     params.Handle = SHFL_HANDLE_NIL;
     params.CreateFlags = SHFL_CF_LOOKUP | SHFL_CF_ACT_FAIL_IF_NEW;
     LogFunc(("sf_stat: calling vboxCallCreate, file %s, flags %#x\n",
-             path->String.utf8, params.CreateFlags));
-    rc = vboxCallCreate(&client_handle, &sf_g->map, path, &params);
+             str->String.utf8, params.CreateFlags));
+    rc = vboxCallCreate(&client_handle, &sf_g->map, str, &params);
+    sf_path_str_done(str);
     if (rc == VERR_INVALID_NAME)
     {
         /* this can happen for names like 'foo*' on a Windows host */
@@ -193,14 +231,14 @@ int sf_stat(const char *caller, struct sf_glob_info *sf_g,
     if (RT_FAILURE(rc))
     {
         LogFunc(("vboxCallCreate(%s) failed.  caller=%s, rc=%Rrc\n",
-                    path->String.utf8, rc, caller));
+                    path->name, rc, caller));
         return -EPROTO;
     }
     if (params.Result != SHFL_FILE_EXISTS)
     {
         if (!ok_to_fail)
             LogFunc(("vboxCallCreate(%s) file does not exist.  caller=%s, result=%d\n",
-                        path->String.utf8, params.Result, caller));
+                        path->name, params.Result, caller));
         return -ENOENT;
     }
 
@@ -208,6 +246,91 @@ int sf_stat(const char *caller, struct sf_glob_info *sf_g,
     return 0;
 }
 
+/* inode number of the host object [info], 0 if the host doesn't tell */
+ino_t sf_host_ino(PSHFLFSOBJINFO info)
+{
+    if (info->Attr.enmAdditional != RTFSOBJATTRADD_UNIX)
+        return 0;
+    return (ino_t)info->Attr.u.Unix.INodeId;
+}
+
+/* update [inode] with the fresh host attributes [info], dropping cached
+   pages and handles if the file changed on the host */
+void sf_inode_refresh(struct inode *inode, PSHFLFSOBJINFO info)
+{
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+    time_t old_time;
+    time_t old_ctime = inode->i_ctime.tv_sec;
+    unsigned long timeo, timeo_min, timeo_max;
+    int changed;
+
+    if (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY))
+    {
+        /* write-back data not on the host yet: our size and modification
+           time are newer than the host's */
+        info->cbObject = i_size_read(inode);
+        sf_timespec_from_ftime(&info->ModificationTime, &inode->i_mtime);
+    }
+
+    old_time = inode->i_mtime.tv_sec;
+    sf_ftime_from_timespec(&inode->i_mtime, &info->ModificationTime);
+
+    changed = info->cbObject != inode->i_size || old_time != inode->i_mtime.tv_sec;
+    if (changed)
+    {
+        invalidate_inode_pages2(inode->i_mapping);
+        sf_handle_invalidate(sf_g, sf_i);
+        /* directory content changed on the host, drop the cached listing */
+        if (S_ISDIR(inode->i_mode))
+            sf_i->force_reread = 1;
+    }
+
+    sf_init_inode(sf_g, inode, info);
+    sf_i->force_restat = 0;
+
+    /* like NFS: the longer the attributes stay the same, the longer they
+       are trusted, any change (including chmod etc.) starts over */
+    changed |= old_ctime != inode->i_ctime.tv_sec;
+    timeo_min = S_ISDIR(inode->i_mode) ? sf_g->acdirmin : sf_g->acregmin;
+    timeo_max = S_ISDIR(inode->i_mode) ? sf_g->acdirmax : sf_g->acregmax;
+    timeo = changed ? timeo_min : (sf_i->attr_timeo ? 2 * sf_i->attr_timeo : 1);
+    if (timeo < timeo_min)
+        timeo = timeo_min;
+    if (timeo > timeo_max)
+        timeo = timeo_max;
+    sf_i->attr_timeo = timeo;
+    sf_i->attr_time = jiffies;
+}
+
+/* the attributes of [inode] were just fetched from the host */
+void sf_inode_attr_reset(struct inode *inode)
+{
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(inode->i_sb);
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+
+    sf_i->attr_timeo = S_ISDIR(inode->i_mode) ? sf_g->acdirmin : sf_g->acregmin;
+    sf_i->attr_time = jiffies;
+}
+
+/* can the cached attributes of [inode] be used without asking the host?
+   doesn't sleep, used in RCU path walk as well */
+int sf_inode_attr_fresh(struct inode *inode)
+{
+    struct sf_inode_info *sf_i = GET_INODE_INFO(inode);
+
+    return    !ACCESS_ONCE(sf_i->force_restat)
+           && !time_after(jiffies, ACCESS_ONCE(sf_i->attr_time)
+                                   + ACCESS_ONCE(sf_i->attr_timeo));
+}
+
+/* update the inode of [dentry] with the fresh host attributes [info] */
+void sf_inode_update(struct dentry *dentry, PSHFLFSOBJINFO info)
+{
+    dentry->d_time = jiffies;
+    sf_inode_refresh(dentry->d_inode, info);
+}
+
 /* this is called directly as iop on 2.4, indirectly as dop
    [sf_dentry_revalidate] on 2.4/2.6, indirectly as iop through
    [sf_getattr] on 2.6. the job is to find out whether dentry/inode is
@@ -220,7 +343,6 @@ int sf_inode_revalidate(struct dentry *dentry)
     struct sf_glob_info *sf_g;
     struct sf_inode_info *sf_i;
     SHFLFSOBJINFO info;
-    time_t old_time;
 
     TRACE();
     if (!dentry || !dentry->d_inode)
@@ -234,7 +356,7 @@ int sf_inode_revalidate(struct dentry *dentry)
 
 #if 0
     printk("%s called by %p:%p\n",
-            sf_i->path->String.utf8,
+            sf_i->path->name,
             __builtin_return_address (0),
             __builtin_return_address (1));
 #endif
@@ -242,34 +364,64 @@ int sf_inode_revalidate(struct dentry *dentry)
     BUG_ON(!sf_g);
     BUG_ON(!sf_i);
 
-    if (!sf_i->force_restat)
-    {
-        if (jiffies - dentry->d_time <= sf_g->ttl)
-            return 0;
-    }
+    if (sf_inode_attr_fresh(dentry->d_inode))
+        return 0;
 
     err = sf_stat(__func__, sf_g, sf_i->path, &info, 1);
     if (err)
+    {
+        sf_handle_invalidate(sf_g, sf_i);
         return err;
+    }
 
-    dentry->d_time = jiffies;
+    sf_inode_update(dentry, &info);
+    return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+# ifndef LOOKUP_RENAME_TARGET
+#  define LOOKUP_RENAME_TARGET 0
+# endif
+/* is the negative [dentry] still valid? it is for negttl after the lookup
+   unless the directory was changed locally since. a negative dentry about
+   to be created must be looked up again, the host may know the name. */
+static int sf_negative_dentry_valid(struct dentry *dentry, unsigned flags)
+{
+    struct sf_glob_info *sf_g = GET_GLOB_INFO(dentry->d_sb);
+    struct dentry *parent;
+    int valid;
+
+    if (!sf_g->negttl || (flags & (LOOKUP_CREATE | LOOKUP_RENAME_TARGET)))
+        return 0;
+    if (!time_before(jiffies, dentry->d_time + sf_g->negttl))
+        return 0;
 
-    old_time = dentry->d_inode->i_mtime.tv_sec;
-    sf_ftime_from_timespec(&dentry->d_inode->i_mtime, &info.ModificationTime);
+#ifdef LOOKUP_RCU
+    if (flags & LOOKUP_RCU)
+    {
+        /* no references in RCU path walk, the parent stays around */
+        struct inode *dir = ACCESS_ONCE(ACCESS_ONCE(dentry->d_parent)->d_inode);
+        struct sf_inode_info *sf_dir_i = dir ? GET_INODE_INFO(dir) : NULL;
 
-    if ( info.cbObject != dentry->d_inode->i_size ||
-              old_time != dentry->d_inode->i_mtime.tv_sec){
-        invalidate_inode_pages2(dentry->d_inode->i_mapping);
+        return    sf_dir_i
+               && time_after((unsigned long)dentry->d_time,
+                             ACCESS_ONCE(sf_dir_i->dir_stamp));
     }
+#endif
 
-    sf_init_inode(sf_g, dentry->d_inode, &info);
-    sf_i->force_restat = 0;
-    return 0;
+    parent = dget_parent(dentry);
+    valid = time_after((unsigned long)dentry->d_time,
+                       GET_INODE_INFO(parent->d_inode)->dir_stamp);
+    dput(parent);
+    return valid;
 }
+#endif
 
 /* this is called during name resolution/lookup to check if the
    [dentry] in the cache is still valid. the job is handled by
-   [sf_inode_revalidate] */
+   [sf_inode_revalidate]. in RCU path walk nothing may sleep, the dentry
+   is valid if its cached state says so, everything needing the host is
+   left to ref-walk */
 static int
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
 sf_dentry_revalidate(struct dentry *dentry, unsigned flags)
@@ -279,15 +431,29 @@ sf_dentry_revalidate(struct dentry *dentry, struct nameidata *nd)
 sf_dentry_revalidate(struct dentry *dentry, int flags)
 #endif
 {
+    struct inode *inode;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 6, 0) && LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+    unsigned flags = nd ? nd->flags : 0;
+#endif
+
     TRACE();
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0)
-    if (flags & LOOKUP_RCU)
-        return -ECHILD;
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+    inode = ACCESS_ONCE(dentry->d_inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
     /* see Documentation/filesystems/vfs.txt */
-    if (nd && nd->flags & LOOKUP_RCU)
-        return -ECHILD;
+    if (flags & LOOKUP_RCU)
+    {
+        if (!inode)
+            return sf_negative_dentry_valid(dentry, flags) ? 1 : -ECHILD;
+        return sf_inode_attr_fresh(inode) ? 1 : -ECHILD;
+    }
+#endif
+
+    if (!inode)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+        return sf_negative_dentry_valid(dentry, flags);
+#else
+        return 0;
 #endif
 
     if (sf_inode_revalidate(dentry))
@@ -316,42 +482,63 @@ int sf_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *kstat)
 
 int sf_setattr(struct dentry *dentry, struct iattr *iattr)
 {
+    struct inode *inode = dentry->d_inode;
     struct sf_glob_info *sf_g;
     struct sf_inode_info *sf_i;
+    struct sf_handle *sf_h;
+    SHFLHANDLE handle;
     SHFLCREATEPARMS params;
     SHFLFSOBJINFO info;
+    SHFLSTRING *path;
     uint32_t cbBuffer;
     int rc, err;
 
     TRACE();
 
-    sf_g = GET_GLOB_INFO(dentry->d_inode->i_sb);
-    sf_i = GET_INODE_INFO(dentry->d_inode);
+    sf_g = GET_GLOB_INFO(inode->i_sb);
+    sf_i = GET_INODE_INFO(inode);
     err  = 0;
+    cbBuffer = 0;
 
-    RT_ZERO(params);
-    params.Handle = SHFL_HANDLE_NIL;
-    params.CreateFlags = SHFL_CF_ACT_OPEN_IF_EXISTS
-                       | SHFL_CF_ACT_FAIL_IF_NEW
-                       | SHFL_CF_ACCESS_ATTR_WRITE;
-
-    /* this is at least required for Posix hosts */
-    if (iattr->ia_valid & ATTR_SIZE)
-        params.CreateFlags |= SHFL_CF_ACCESS_WRITE;
-
-    rc = vboxCallCreate(&client_handle, &sf_g->map, sf_i->path, &params);
-    if (RT_FAILURE(rc))
-    {
-        LogFunc(("vboxCallCreate(%s) failed rc=%Rrc\n",
-                 sf_i->path->String.utf8, rc));
-        err = -RTErrConvertToErrno(rc);
-        goto fail2;
-    }
-    if (params.Result != SHFL_FILE_EXISTS)
+    /* A host handle with write access, open or still cached, takes the
+     * new attributes as well as one opened just for this. */
+    sf_h = sf_handle_find(sf_g, sf_i, SHFL_CF_ACCESS_WRITE, SHFL_CF_ACCESS_WRITE);
+    if (sf_h)
+        handle = sf_h->handle;
+    else
     {
-        LogFunc(("file %s does not exist\n", sf_i->path->String.utf8));
-        err = -ENOENT;
-        goto fail1;
+        RT_ZERO(params);
+        params.Handle = SHFL_HANDLE_NIL;
+        params.CreateFlags = SHFL_CF_ACT_OPEN_IF_EXISTS
+                           | SHFL_CF_ACT_FAIL_IF_NEW
+                           | SHFL_CF_ACCESS_ATTR_WRITE;
+
+        /* this is at least required for Posix hosts */
+        if (iattr->ia_valid & ATTR_SIZE)
+            params.CreateFlags |= SHFL_CF_ACCESS_WRITE;
+
+        path = sf_path_str(sf_i->path);
+        if (IS_ERR(path))
+        {
+            err = PTR_ERR(path);
+            goto fail2;
+        }
+        rc = vboxCallCreate(&client_handle, &sf_g->map, path, &params);
+        sf_path_str_done(path);
+        if (RT_FAILURE(rc))
+        {
+            LogFunc(("vboxCallCreate(%s) failed rc=%Rrc\n",
+                     sf_i->path->name, rc));
+            err = -RTErrConvertToErrno(rc);
+            goto fail2;
+        }
+        handle = params.Handle;
+        if (params.Result != SHFL_FILE_EXISTS)
+        {
+            LogFunc(("file %s does not exist\n", sf_i->path->name));
+            err = -ENOENT;
+            goto fail1;
+        }
     }
 
     /* Setting the file size and setting the other attributes has to be
@@ -389,13 +576,13 @@ int sf_setattr(struct dentry *dentry, struct iattr *iattr)
         /* ignore ctime (inode change time) as it can't be set from userland anyway */
 
         cbBuffer = sizeof(info);
-        rc = vboxCallFSInfo(&client_handle, &sf_g->map, params.Handle,
+        rc = vboxCallFSInfo(&client_handle, &sf_g->map, handle,
                 SHFL_INFO_SET | SHFL_INFO_FILE, &cbBuffer,
                 (PSHFLDIRINFO)&info);
         if (RT_FAILURE(rc))
         {
             LogFunc(("vboxCallFSInfo(%s, FILE) failed rc=%Rrc\n",
-                        sf_i->path->String.utf8, rc));
+                        sf_i->path->name, rc));
             err = -RTErrConvertToErrno(rc);
             goto fail1;
         }
@@ -406,103 +593,324 @@ int sf_setattr(struct dentry *dentry, struct iattr *iattr)
         RT_ZERO(info);
         info.cbObject = iattr->ia_size;
         cbBuffer = sizeof(info);
-        rc = vboxCallFSInfo(&client_handle, &sf_g->map, params.Handle,
+        rc = vboxCallFSInfo(&client_handle, &sf_g->map, handle,
                             SHFL_INFO_SET | SHFL_INFO_SIZE, &cbBuffer,
                             (PSHFLDIRINFO)&info);
         if (RT_FAILURE(rc))
         {
             LogFunc(("vboxCallFSInfo(%s, SIZE) failed rc=%Rrc\n",
-                        sf_i->path->String.utf8, rc));
+                        sf_i->path->name, rc));
             err = -RTErrConvertToErrno(rc);
             goto fail1;
         }
     }
 
-    rc = vboxCallClose(&client_handle, &sf_g->map, params.Handle);
-    if (RT_FAILURE(rc))
-        LogFunc(("vboxCallClose(%s) failed rc=%Rrc\n", sf_i->path->String.utf8, rc));
+    if (sf_h)
+        sf_handle_release(sf_g, sf_i, sf_h);
+    else
+    {
+        rc = vboxCallClose(&client_handle, &sf_g->map, handle);
+        if (RT_FAILURE(rc))
+            LogFunc(("vboxCallClose(%s) failed rc=%Rrc\n", sf_i->path->name, rc));
+    }
+
+    if (iattr->ia_valid & ATTR_SIZE)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+        truncate_setsize(inode, iattr->ia_size);
+#else
+        vmtruncate(inode, iattr->ia_size);
+#endif
+
+    /* The host answers a set with the resulting attributes of the file,
+     * our zeroed request has no valid enmAdditional. The new size and
+     * times are our own change, so the page cache and handles stay
+     * valid. */
+    if (   cbBuffer == sizeof(info)
+        && info.Attr.enmAdditional >= RTFSOBJATTRADD_NOTHING
+        && (info.Attr.fMode & RTFS_TYPE_MASK))
+    {
+        if (info.Attr.enmAdditional == RTFSOBJATTRADD_UNIX)
+        {
+            sf_ftime_from_timespec(&inode->i_mtime, &info.ModificationTime);
+            sf_inode_refresh(inode, &info);
+            return 0;
+        }
+
+        /* Without the Unix attributes the answer has neither the link
+         * count nor the host object id, take only the mode and times and
+         * keep the rest (the size was set above). */
+        if (iattr->ia_valid & ATTR_MODE)
+            inode->i_mode = (inode->i_mode & S_IFMT) | sf_attr_mode(sf_g, &info.Attr);
+        sf_ftime_from_timespec(&inode->i_atime, &info.AccessTime);
+        sf_ftime_from_timespec(&inode->i_ctime, &info.ChangeTime);
+        if (!mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY))
+            sf_ftime_from_timespec(&inode->i_mtime, &info.ModificationTime);
+        return 0;
+    }
 
-    // To get the host dentry forcibly.
-    dentry->d_time = 0;
+    /* the cached attributes are out of date whatever their timeout */
+    sf_i->force_restat = 1;
     return sf_inode_revalidate(dentry);
 
 fail1:
-    rc = vboxCallClose(&client_handle, &sf_g->map, params.Handle);
-    if (RT_FAILURE(rc))
-        LogFunc(("vboxCallClose(%s) failed rc=%Rrc\n", sf_i->path->String.utf8, rc));
+    if (sf_h)
+        sf_handle_release(sf_g, sf_i, sf_h);
+    else
+    {
+        rc = vboxCallClose(&client_handle, &sf_g->map, handle);
+        if (RT_FAILURE(rc))
+            LogFunc(("vboxCallClose(%s) failed rc=%Rrc\n", sf_i->path->name, rc));
+    }
 
 fail2:
     return err;
 }
 #endif /* >= 2.6.0 */
 
-static int sf_make_path(const char *caller, struct sf_inode_info *sf_i,
-                        const char *d_name, size_t d_len, SHFLSTRING **result)
-{
-    size_t path_len, shflstring_len;
-    SHFLSTRING *tmp;
-    uint16_t p_len;
-    uint8_t *p_name;
-    int fRoot = 0;
+/*
+ * Host paths are kept as a tree of refcounted components: every inode
+ * references the component of its name, every component its parent's.
+ * Renaming a directory thus changes a single component and the paths of
+ * all cached descendants follow.  The full path is only assembled when a
+ * host call needs it.  sf_path_lock protects the parent and name of all
+ * components against rename.
+ */
+static DEFINE_RWLOCK(sf_path_lock);
 
-    TRACE();
-    p_len = sf_i->path->u16Length;
-    p_name = sf_i->path->String.utf8;
+/* room for the path in a PATH_MAX sized buffer with an SHFLSTRING header */
+#define SF_PATH_STR_MAX (PATH_MAX - offsetof(SHFLSTRING, String.utf8))
 
-    if (p_len == 1 && *p_name == '/')
-    {
-        path_len = d_len + 1;
-        fRoot = 1;
-    }
+/**
+ * Allocate a component [name] below [parent] (NULL for the root of the
+ * share), the new component holds a reference to [parent].
+ *
+ * @returns the component with one reference, NULL if out of memory
+ */
+struct sf_path *sf_path_alloc(struct sf_path *parent, const char *name, size_t len)
+{
+    struct sf_path *p;
+
+    p = kmem_cache_alloc(sf_path_cachep, GFP_KERNEL);
+    if (!p)
+        return NULL;
+    if (len <= SF_PATH_INLINE_LEN)
+        p->name = p->iname;
     else
     {
-        /* lengths of constituents plus terminating zero plus slash  */
-        path_len = p_len + d_len + 2;
-        if (path_len > 0xffff)
+        p->name = kmalloc(len + 1, GFP_KERNEL);
+        if (!p->name)
         {
-            LogFunc(("path too long.  caller=%s, path_len=%zu\n", caller, path_len));
-            return -ENAMETOOLONG;
+            kmem_cache_free(sf_path_cachep, p);
+            return NULL;
         }
     }
+    memcpy(p->name, name, len);
+    p->name[len] = '\0';
+    p->len = len;
+    atomic_set(&p->refs, 1);
+    p->parent = parent;
+    if (parent)
+        atomic_inc(&parent->refs);
+    return p;
+}
 
-    shflstring_len = offsetof(SHFLSTRING, String.utf8) + path_len;
-    tmp = kmalloc(shflstring_len, GFP_KERNEL);
-    if (!tmp)
+/**
+ * Drop a reference to the component [p], freeing it and dropping the
+ * reference to its parent with the last one.
+ */
+void sf_path_put(struct sf_path *p)
+{
+    while (p && atomic_dec_and_test(&p->refs))
     {
-        LogRelFunc(("kmalloc failed, caller=%s\n", caller));
-        return -ENOMEM;
+        /* nobody else sees [p] anymore, no rename can move it */
+        struct sf_path *parent = p->parent;
+
+        if (p->name != p->iname)
+            kfree(p->name);
+        kmem_cache_free(sf_path_cachep, p);
+        p = parent;
     }
-    tmp->u16Length = path_len - 1;
-    tmp->u16Size = path_len;
+}
 
-    if (fRoot)
-        memcpy(&tmp->String.utf8[0], d_name, d_len + 1);
+/**
+ * Give the component [p] the parent and name of [to] after a successful
+ * rename on the host and drop the caller's reference to [to].
+ */
+void sf_path_move(struct sf_path *p, struct sf_path *to)
+{
+    struct sf_path *parent;
+    char *old_name;
+
+    write_lock(&sf_path_lock);
+    parent = p->parent;
+    p->parent = to->parent;
+    to->parent = parent;
+    old_name = p->name != p->iname ? p->name : NULL;
+    if (to->name == to->iname)
+    {
+        memcpy(p->iname, to->iname, to->len + 1);
+        p->name = p->iname;
+    }
     else
     {
-        memcpy(&tmp->String.utf8[0], p_name, p_len);
-        tmp->String.utf8[p_len] = '/';
-        memcpy(&tmp->String.utf8[p_len + 1], d_name, d_len);
-        tmp->String.utf8[p_len + 1 + d_len] = '\0';
+        p->name = to->name;
+        to->name = to->iname;
+    }
+    p->len = to->len;
+    write_unlock(&sf_path_lock);
+
+    kfree(old_name);
+    /* drops the reference to the old parent */
+    sf_path_put(to);
+}
+
+/* does the component [p] have the parent and name of [q] */
+int sf_path_equal(struct sf_path *p, struct sf_path *q)
+{
+    int equal;
+
+    read_lock(&sf_path_lock);
+    equal =    p->parent == q->parent
+            && p->len == q->len
+            && !memcmp(p->name, q->name, p->len);
+    read_unlock(&sf_path_lock);
+    return equal;
+}
+
+/**
+ * Assemble the full path of [p], followed by "/[name]" if [name] is not
+ * NULL, into [str] which has room for [cbMax] bytes of path.  The caller
+ * holds sf_path_lock for reading.
+ *
+ * @returns 0 on success, -ENAMETOOLONG if [str] is too small
+ */
+static int sf_path_fill(struct sf_path *p, const char *name, size_t len,
+                        SHFLSTRING *str, size_t cbMax)
+{
+    struct sf_path *q;
+    size_t path_len = 0;
+    size_t pos;
+
+    for (q = p; q->parent; q = q->parent)
+        path_len += q->len + 1;
+    if (name)
+        path_len += len + 1;
+    /* the root of the share is "/" */
+    if (!path_len)
+        path_len = 1;
+    if (path_len + 1 > cbMax || path_len + 1 > 0xffff)
+        return -ENAMETOOLONG;
+
+    str->u16Length = path_len;
+    str->u16Size = path_len + 1;
+    str->String.utf8[path_len] = '\0';
+    str->String.utf8[0] = '/';
+
+    pos = path_len;
+    if (name)
+    {
+        pos -= len;
+        memcpy(&str->String.utf8[pos], name, len);
+        str->String.utf8[--pos] = '/';
+    }
+    for (q = p; q->parent; q = q->parent)
+    {
+        pos -= q->len;
+        memcpy(&str->String.utf8[pos], q->name, q->len);
+        str->String.utf8[--pos] = '/';
+    }
+    return 0;
+}
+
+/**
+ * Assemble the full path of [p] for a host call in a buffer of its own,
+ * free it with sf_path_str_done() once the call returned.
+ *
+ * @returns the path, ERR_PTR with a Linux error code otherwise
+ */
+SHFLSTRING *sf_path_str(struct sf_path *p)
+{
+    return sf_path_str_name(p, NULL, 0);
+}
+
+/**
+ * Like sf_path_str(), but append "/[name]" if [name] is not NULL.
+ */
+SHFLSTRING *sf_path_str_name(struct sf_path *p, const char *name, size_t len)
+{
+    SHFLSTRING *str;
+    int err;
+
+    /* the names_cache of the VFS has just the right size */
+    str = (SHFLSTRING *)__getname();
+    if (!str)
+    {
+        LogRelFunc(("__getname failed\n"));
+        return ERR_PTR(-ENOMEM);
+    }
+
+    read_lock(&sf_path_lock);
+    err = sf_path_fill(p, name, len, str, SF_PATH_STR_MAX);
+    read_unlock(&sf_path_lock);
+    if (err)
+    {
+        LogFunc(("path too long: %s\n", p->name));
+        __putname(str);
+        return ERR_PTR(err);
+    }
+    return str;
+}
+
+void sf_path_str_done(SHFLSTRING *str)
+{
+    __putname(str);
+}
+
+/**
+ * Allocate the full path of [p], followed by "/[d_name]" if [d_name] is not
+ * NULL, for callers which need it longer or more than one at a time.  Free
+ * it with sf_free_path().
+ *
+ * @returns 0 on success, Linux error code otherwise
+ */
+int sf_make_path(const char *caller, struct sf_path *p,
+                 const char *d_name, size_t d_len, SHFLSTRING **result)
+{
+    SHFLSTRING *tmp;
+
+    TRACE();
+    tmp = sf_path_str_name(p, d_name, d_len);
+    if (IS_ERR(tmp))
+    {
+        LogFunc(("could not make path, caller=%s\n", caller));
+        return PTR_ERR(tmp);
     }
 
     *result = tmp;
     return 0;
 }
 
+void sf_free_path(SHFLSTRING *str)
+{
+    if (str)
+        __putname(str);
+}
+
 /**
  * [dentry] contains string encoded in coding system that corresponds
  * to [sf_g]->nls, we must convert it to UTF8 here and pass down to
- * [sf_make_path] which will allocate SHFLSTRING and fill it in
+ * [sf_path_alloc] which will allocate the component below [sf_i]'s
  */
 int sf_path_from_dentry(const char *caller, struct sf_glob_info *sf_g,
                         struct sf_inode_info *sf_i, struct dentry *dentry,
-                        SHFLSTRING **result)
+                        struct sf_path **result)
 {
     int err;
     const char *d_name;
     size_t d_len;
     const char *name;
     size_t len = 0;
+    char *buf = NULL;
 
     TRACE();
     d_name = dentry->d_name.name;
@@ -517,8 +925,14 @@ int sf_path_from_dentry(const char *caller, struct sf_glob_info *sf_g,
         in = d_name;
         in_len = d_len;
 
+        buf = __getname();
+        if (!buf)
+        {
+            LogRelFunc(("__getname failed, caller=%s\n", caller));
+            return -ENOMEM;
+        }
         out_bound_len = PATH_MAX;
-        out = kmalloc(out_bound_len, GFP_KERNEL);
+        out = buf;
         name = out;
 
         for (i = 0; i < d_len; ++i)
@@ -555,7 +969,7 @@ int sf_path_from_dentry(const char *caller, struct sf_glob_info *sf_g,
             out += nb;
             len += nb;
         }
-        if (len >= PATH_MAX - 1)
+        if (len >= SF_PATH_STR_MAX - 1)
         {
             err = -ENAMETOOLONG;
             goto fail1;
@@ -570,14 +984,18 @@ int sf_path_from_dentry(const char *caller, struct sf_glob_info *sf_g,
         len = d_len;
     }
 
-    err = sf_make_path(caller, sf_i, name, len, result);
-    if (name != d_name)
-        kfree(name);
-
-    return err;
+    *result = sf_path_alloc(sf_i->path, name, len);
+    if (!*result)
+    {
+        LogRelFunc(("kmalloc failed, caller=%s\n", caller));
+        err = -ENOMEM;
+    }
+    else
+        err = 0;
 
 fail1:
-    kfree(name);
+    if (buf)
+        __putname(buf);
     return err;
 }
 
@@ -645,12 +1063,12 @@ int sf_nlscpy(struct sf_glob_info *sf_g,
     return 0;
 }
 
-static struct sf_dir_buf *sf_dir_buf_alloc(void)
+struct sf_dir_buf *sf_dir_buf_alloc(void)
 {
     struct sf_dir_buf *b;
 
     TRACE();
-    b = kmalloc(sizeof(*b), GFP_KERNEL);
+    b = kmem_cache_alloc(sf_dir_buf_cachep, GFP_KERNEL);
     if (!b)
     {
         LogRelFunc(("could not alloc directory buffer\n"));
@@ -664,7 +1082,7 @@ static struct sf_dir_buf *sf_dir_buf_alloc(void)
 #endif
     if (!b->buf)
     {
-        kfree(b);
+        kmem_cache_free(sf_dir_buf_cachep, b);
         LogRelFunc(("could not alloc directory buffer storage\n"));
         return NULL;
     }
@@ -676,7 +1094,7 @@ static struct sf_dir_buf *sf_dir_buf_alloc(void)
     return b;
 }
 
-static void sf_dir_buf_free(struct sf_dir_buf *b)
+void sf_dir_buf_free(struct sf_dir_buf *b)
 {
     BUG_ON(!b || !b->buf);
 
@@ -687,7 +1105,68 @@ static void sf_dir_buf_free(struct sf_dir_buf *b)
 #else
     kfree(b->buf);
 #endif
-    kfree(b);
+    kmem_cache_free(sf_dir_buf_cachep, b);
+}
+
+/* free the entry index of [p] */
+static void sf_dir_info_free_index(struct sf_dir_info *p)
+{
+    if (!p->index)
+        return;
+    if (is_vmalloc_addr(p->index))
+        vfree(p->index);
+    else
+        kfree(p->index);
+    p->index = NULL;
+    p->cEntries = 0;
+}
+
+/**
+ * Build the index of the entries of [sf_d] in the order sf_getdent()
+ * returns them.
+ *
+ * @returns 0 on success, Linux error code otherwise
+ */
+int sf_dir_info_index(struct sf_dir_info *sf_d)
+{
+    struct list_head *pos;
+    size_t cEntries = 0, cb, i;
+    SHFLDIRINFO **index;
+
+    list_for_each(pos, &sf_d->info_list)
+        cEntries += list_entry(pos, struct sf_dir_buf, head)->cEntries;
+
+    /* big directories would need a high order allocation */
+    cb = RT_MAX(cEntries, 1) * sizeof(*index);
+    if (cb <= PAGE_SIZE)
+        index = kmalloc(cb, GFP_KERNEL);
+    else
+        index = vmalloc(cb);
+    if (!index)
+    {
+        LogRelFunc(("could not allocate directory index\n"));
+        return -ENOMEM;
+    }
+
+    cEntries = 0;
+    list_for_each(pos, &sf_d->info_list)
+    {
+        struct sf_dir_buf *b = list_entry(pos, struct sf_dir_buf, head);
+        SHFLDIRINFO *info = b->buf;
+
+        for (i = 0; i < b->cEntries; i++)
+        {
+            index[cEntries++] = info;
+            info = (SHFLDIRINFO *)((uintptr_t)info
+                                   + offsetof(SHFLDIRINFO, name.String)
+                                   + info->name.u16Size);
+        }
+    }
+
+    sf_dir_info_free_index(sf_d);
+    sf_d->index = index;
+    sf_d->cEntries = cEntries;
+    return 0;
 }
 
 /**
@@ -698,6 +1177,7 @@ void sf_dir_info_free(struct sf_dir_info *p)
     struct list_head *list, *pos, *tmp;
 
     TRACE();
+    sf_dir_info_free_index(p);
     list = &p->info_list;
     list_for_each_safe(pos, tmp, list)
     {
@@ -706,7 +1186,16 @@ void sf_dir_info_free(struct sf_dir_info *p)
         b = list_entry(pos, struct sf_dir_buf, head);
         sf_dir_buf_free(b);
     }
-    kfree(p);
+    kmem_cache_free(sf_dir_info_cachep, p);
+}
+
+/**
+ * Drop a reference to the directory buffer, freeing it with the last one.
+ */
+void sf_dir_info_put(struct sf_dir_info *p)
+{
+    if (atomic_dec_and_test(&p->refs))
+        sf_dir_info_free(p);
 }
 
 /**
@@ -716,6 +1205,7 @@ void sf_dir_info_empty(struct sf_dir_info *p)
 {
     struct list_head *list, *pos, *tmp;
     TRACE();
+    sf_dir_info_free_index(p);
     list = &p->info_list;
     list_for_each_safe(pos, tmp, list)
     {
@@ -735,14 +1225,21 @@ struct sf_dir_info *sf_dir_info_alloc(void)
     struct sf_dir_info *p;
 
     TRACE();
-    p = kmalloc(sizeof(*p), GFP_KERNEL);
+    p = kmem_cache_alloc(sf_dir_info_cachep, GFP_KERNEL);
     if (!p)
     {
         LogRelFunc(("could not alloc directory info\n"));
         return NULL;
     }
 
+    atomic_set(&p->refs, 1);
     INIT_LIST_HEAD(&p->info_list);
+    p->index = NULL;
+    p->cEntries = 0;
+    p->fetched = jiffies;
+    INIT_LIST_HEAD(&p->lru);
+    p->sf_i = NULL;
+    p->cbCached = 0;
     return p;
 }
 
@@ -779,9 +1276,12 @@ int sf_dir_read_all(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
     struct sf_dir_buf *b;
 
     TRACE();
-    err = sf_make_path(__func__, sf_i, "*", 1, &mask);
-    if (err)
+    mask = sf_path_str_name(sf_i->path, "*", 1);
+    if (IS_ERR(mask))
+    {
+        err = PTR_ERR(mask);
         goto fail0;
+    }
 
     for (;;)
     {
@@ -834,40 +1334,158 @@ int sf_dir_read_all(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
     err = 0;
 
 fail1:
-    kfree(mask);
+    sf_path_str_done(mask);
 
 fail0:
     return err;
 }
 
-int sf_get_volume_info(struct super_block *sb, STRUCT_STATFS *stat)
+/**
+ * Replace the content of [b] with the next batch of entries of the
+ * directory open as [handle].
+ *
+ * @returns 0 if there may be more entries, 1 if the host has no more,
+ *          Linux error code otherwise
+ */
+int sf_dir_read_batch(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                      SHFLHANDLE handle, struct sf_dir_buf *b)
+{
+    int rc;
+    SHFLSTRING *mask;
+    uint32_t cbSize;
+    uint32_t cEntries = 0;
+
+    TRACE();
+    mask = sf_path_str_name(sf_i->path, "*", 1);
+    if (IS_ERR(mask))
+        return PTR_ERR(mask);
+
+    b->cEntries = 0;
+    b->cbUsed   = 0;
+    b->cbFree   = DIR_BUFFER_SIZE;
+
+    cbSize = b->cbFree;
+    rc = vboxCallDirInfo(&client_handle, &sf_g->map, handle, mask,
+                         0, 0, &cbSize, b->buf, &cEntries);
+    sf_path_str_done(mask);
+    switch (rc)
+    {
+        case VINF_SUCCESS:
+            /* fallthrough */
+        case VERR_NO_MORE_FILES:
+            break;
+        case VERR_NO_TRANSLATION:
+            LogFunc(("host could not translate entry\n"));
+            /* XXX */
+            break;
+        default:
+            LogFunc(("vboxCallDirInfo failed rc=%Rrc\n", rc));
+            return -RTErrConvertToErrno(rc);
+    }
+
+    b->cEntries = cEntries;
+    b->cbFree  -= cbSize;
+    b->cbUsed   = cbSize;
+
+    /* like sf_dir_read_all, stop at the first failure */
+    return RT_FAILURE(rc) || !cEntries ? 1 : 0;
+}
+
+/* ask the host for the volume information of [sf_g] and cache it */
+static int sf_vol_refresh(struct sf_glob_info *sf_g, SHFLVOLINFO *result)
 {
-    struct sf_glob_info *sf_g;
     SHFLVOLINFO SHFLVolumeInfo;
     uint32_t cbBuffer;
     int rc;
 
-    sf_g = GET_GLOB_INFO(sb);
     cbBuffer = sizeof(SHFLVolumeInfo);
     rc = vboxCallFSInfo(&client_handle, &sf_g->map, 0, SHFL_INFO_GET | SHFL_INFO_VOLUME,
                         &cbBuffer, (PSHFLDIRINFO)&SHFLVolumeInfo);
     if (RT_FAILURE(rc))
+    {
+        LogFunc(("vboxCallFSInfo failed rc=%Rrc\n", rc));
         return -RTErrConvertToErrno(rc);
+    }
+
+    spin_lock(&sf_g->vol_lock);
+    sf_g->vol_info = SHFLVolumeInfo;
+    sf_g->vol_time = jiffies;
+    sf_g->vol_valid = 1;
+    spin_unlock(&sf_g->vol_lock);
+
+    if (result)
+        *result = SHFLVolumeInfo;
+    return 0;
+}
+
+/* refresh the cached volume information in the background */
+void sf_vol_work(struct work_struct *work)
+{
+    struct sf_glob_info *sf_g = container_of(work, struct sf_glob_info, vol_work);
 
-    stat->f_type        = NFS_SUPER_MAGIC; /* XXX vboxsf type? */
-    stat->f_bsize       = SHFLVolumeInfo.ulBytesPerAllocationUnit;
-    stat->f_blocks      = SHFLVolumeInfo.ullTotalAllocationBytes
-                        / SHFLVolumeInfo.ulBytesPerAllocationUnit;
-    stat->f_bfree       = SHFLVolumeInfo.ullAvailableAllocationBytes
-                        / SHFLVolumeInfo.ulBytesPerAllocationUnit;
-    stat->f_bavail      = SHFLVolumeInfo.ullAvailableAllocationBytes
-                        / SHFLVolumeInfo.ulBytesPerAllocationUnit;
-    stat->f_files       = 1000;
-    stat->f_ffree       = 1000; /* don't return 0 here since the guest may think
-                                 * that it is not possible to create any more files */
-    stat->f_fsid.val[0] = 0;
-    stat->f_fsid.val[1] = 0;
-    stat->f_namelen     = 255;
+    sf_vol_refresh(sf_g, NULL);
+}
+
+int sf_get_volume_info(struct super_block *sb, STRUCT_STATFS *stat)
+{
+    struct sf_glob_info *sf_g;
+    SHFLVOLINFO SHFLVolumeInfo;
+    uint32_t cbUnit;
+    int err;
+
+    sf_g = GET_GLOB_INFO(sb);
+    if (sf_g->statfs_ttl)
+    {
+        unsigned long age = 0;
+        int valid;
+
+        spin_lock(&sf_g->vol_lock);
+        valid = sf_g->vol_valid;
+        if (valid)
+        {
+            age = jiffies - sf_g->vol_time;
+            SHFLVolumeInfo = sf_g->vol_info;
+        }
+        spin_unlock(&sf_g->vol_lock);
+
+        /* a little stale is fine while the refresh is on its way, much
+           older isn't */
+        if (!valid || age >= 2 * sf_g->statfs_ttl)
+            valid = 0;
+        else if (age >= sf_g->statfs_ttl)
+            schedule_work(&sf_g->vol_work);
+        if (!valid)
+        {
+            err = sf_vol_refresh(sf_g, &SHFLVolumeInfo);
+            if (err)
+                return err;
+        }
+    }
+    else
+    {
+        err = sf_vol_refresh(sf_g, &SHFLVolumeInfo);
+        if (err)
+            return err;
+    }
+
+    cbUnit = SHFLVolumeInfo.ulBytesPerAllocationUnit;
+    if (!cbUnit)
+        cbUnit = PAGE_SIZE;
+
+    stat->f_type        = VBOXSF_SUPER_MAGIC;
+    stat->f_bsize       = cbUnit;
+    stat->f_blocks      = SHFLVolumeInfo.ullTotalAllocationBytes / cbUnit;
+    stat->f_bfree       = SHFLVolumeInfo.ullAvailableAllocationBytes / cbUnit;
+    stat->f_bavail      = SHFLVolumeInfo.ullAvailableAllocationBytes / cbUnit;
+    /* the host does not tell the number of files, every allocation unit
+       can hold one; never 0 free, the guest would think that it is not
+       possible to create any more files */
+    stat->f_files       = stat->f_blocks;
+    stat->f_ffree       = RT_MAX(stat->f_bfree, 1);
+    stat->f_fsid.val[0] = SHFLVolumeInfo.ulSerial;
+    stat->f_fsid.val[1] = sf_g->map.root;
+    stat->f_namelen     = SHFLVolumeInfo.fsProperties.cbMaxComponent
+                        ? RT_MIN(SHFLVolumeInfo.fsProperties.cbMaxComponent, 255) : 255;
     return 0;
 }
 
@@ -876,23 +1494,338 @@ struct dentry_operations sf_dentry_ops =
     .d_revalidate = sf_dentry_revalidate
 };
 
-int sf_init_backing_dev(struct sf_glob_info *sf_g)
+/* initialize the parts of a cached inode which stay valid while it is free */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+static void sf_inode_info_init_once(void *data)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
+static void sf_inode_info_init_once(struct kmem_cache *cachep, void *data)
+#else
+static void sf_inode_info_init_once(void *data, struct kmem_cache *cachep,
+                                    unsigned long flags)
+#endif
+{
+    struct sf_inode_info *sf_i = data;
+
+    INIT_LIST_HEAD(&sf_i->handles);
+    spin_lock_init(&sf_i->handle_lock);
+    INIT_LIST_HEAD(&sf_i->dirty_entry);
+    mutex_init(&sf_i->flush_mutex);
+    spin_lock_init(&sf_i->flush_lock);
+    inode_init_once(&sf_i->vfs_inode);
+}
+
+/* allocate and initialize the information of a new inode together with
+   the VFS inode, for sf_alloc_inode() */
+struct sf_inode_info *sf_inode_info_alloc(void)
+{
+    struct sf_inode_info *sf_i = kmem_cache_alloc(sf_inode_cachep, GFP_KERNEL);
+
+    if (!sf_i)
+        return NULL;
+
+    /* the lists are empty again when the inode is freed */
+    sf_i->path = NULL;
+    sf_i->force_restat = 0;
+    sf_i->force_reread = 0;
+    sf_i->attr_time = jiffies;
+    sf_i->attr_timeo = 0;
+    sf_i->host_ino = 0;
+    sf_i->host_dev = 0;
+    sf_i->dir_stamp = jiffies;
+    sf_i->dir_cache = NULL;
+    sf_i->handle = SHFL_HANDLE_NIL;
+    sf_i->handle_flags = 0;
+    sf_i->dirtied_when = 0;
+    sf_i->inode = NULL;
+    sf_i->flush_started = 0;
+    sf_i->flush_done = 0;
+    sf_i->flush_err = 0;
+    return sf_i;
+}
+
+void sf_inode_info_free(struct sf_inode_info *sf_i)
+{
+    kmem_cache_free(sf_inode_cachep, sf_i);
+}
+
+struct sf_reg_info *sf_reg_info_alloc(void)
+{
+    return kmem_cache_alloc(sf_reg_info_cachep, GFP_KERNEL);
+}
+
+void sf_reg_info_free(struct sf_reg_info *sf_r)
+{
+    kmem_cache_free(sf_reg_info_cachep, sf_r);
+}
+
+struct sf_dir_file *sf_dir_file_alloc(void)
+{
+    return kmem_cache_alloc(sf_dir_file_cachep, GFP_KERNEL);
+}
+
+void sf_dir_file_free(struct sf_dir_file *sf_f)
+{
+    kmem_cache_free(sf_dir_file_cachep, sf_f);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 23)
+# define SF_CACHE_CREATE(name, type, flags, ctor) \
+    kmem_cache_create(name, sizeof(type), 0, flags, ctor)
+#else
+# define SF_CACHE_CREATE(name, type, flags, ctor) \
+    kmem_cache_create(name, sizeof(type), 0, flags, ctor, NULL)
+#endif
+
+static void sf_cache_destroy(struct kmem_cache **cachep)
+{
+    if (*cachep)
+        kmem_cache_destroy(*cachep);
+    *cachep = NULL;
+}
+
+/**
+ * Create the slab caches of inodes, open files, host handles, path
+ * components and directory listings.
+ *
+ * @returns 0 on success, Linux error code otherwise
+ */
+int sf_caches_init(void)
+{
+    sf_inode_cachep = SF_CACHE_CREATE("vboxsf_inode_cache", struct sf_inode_info,
+                                      SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+                                      sf_inode_info_init_once);
+    sf_reg_info_cachep = SF_CACHE_CREATE("vboxsf_reg_info", struct sf_reg_info,
+                                         0, NULL);
+    sf_dir_file_cachep = SF_CACHE_CREATE("vboxsf_dir_file", struct sf_dir_file,
+                                         0, NULL);
+    sf_handle_cachep = SF_CACHE_CREATE("vboxsf_handle", struct sf_handle,
+                                       0, NULL);
+    sf_path_cachep = SF_CACHE_CREATE("vboxsf_path", struct sf_path,
+                                     SLAB_RECLAIM_ACCOUNT, NULL);
+    sf_dir_info_cachep = SF_CACHE_CREATE("vboxsf_dir_info", struct sf_dir_info,
+                                         0, NULL);
+    sf_dir_buf_cachep = SF_CACHE_CREATE("vboxsf_dir_buf", struct sf_dir_buf,
+                                        0, NULL);
+    if (   !sf_inode_cachep
+        || !sf_reg_info_cachep
+        || !sf_dir_file_cachep
+        || !sf_handle_cachep
+        || !sf_path_cachep
+        || !sf_dir_info_cachep
+        || !sf_dir_buf_cachep)
+    {
+        sf_caches_done();
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void sf_caches_done(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+    /* inodes are freed after an RCU grace period (sf_destroy_inode) */
+    rcu_barrier();
+#endif
+    sf_cache_destroy(&sf_inode_cachep);
+    sf_cache_destroy(&sf_reg_info_cachep);
+    sf_cache_destroy(&sf_dir_file_cachep);
+    sf_cache_destroy(&sf_handle_cachep);
+    sf_cache_destroy(&sf_path_cachep);
+    sf_cache_destroy(&sf_dir_info_cachep);
+    sf_cache_destroy(&sf_dir_buf_cachep);
+}
+
+/**
+ * Make the freshly opened host handle [handle] known to [sf_i] so that it
+ * can be shared by other openers and write-back and cached after the last
+ * close.
+ *
+ * @param sf_i          inode information
+ * @param handle        host handle
+ * @param fFlags        SHFL_CF_ACCESS_* flags the handle was opened with
+ * @returns the handle with one reference, NULL if out of memory
+ */
+struct sf_handle *sf_handle_add(struct sf_inode_info *sf_i, SHFLHANDLE handle,
+                                uint32_t fFlags)
+{
+    /* GFP_NOFS: also called from write-back */
+    struct sf_handle *sf_h = kmem_cache_alloc(sf_handle_cachep, GFP_NOFS);
+
+    if (!sf_h)
+        return NULL;
+
+    INIT_LIST_HEAD(&sf_h->idle_entry);
+    sf_h->sf_i = sf_i;
+    sf_h->refs = 1;
+    sf_h->stale = 0;
+    sf_h->idle_since = 0;
+    sf_h->fFlags = fFlags;
+    sf_h->handle = handle;
+    spin_lock(&sf_i->handle_lock);
+    list_add(&sf_h->entry, &sf_i->handles);
+    spin_unlock(&sf_i->handle_lock);
+    return sf_h;
+}
+
+/**
+ * Find an open host handle of [sf_i] whose SHFL_CF_ACCESS_* flags masked
+ * with [fMask] are [fFlags] and take a reference to it.
+ *
+ * @param sf_g          global information
+ * @param sf_i          inode information
+ * @param fFlags        required SHFL_CF_ACCESS_* flags
+ * @param fMask         flags to compare
+ * @returns the handle, NULL if there is none
+ */
+struct sf_handle *sf_handle_find(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                                 uint32_t fFlags, uint32_t fMask)
+{
+    struct sf_handle *sf_h;
+
+    spin_lock(&sf_i->handle_lock);
+    list_for_each_entry(sf_h, &sf_i->handles, entry)
+    {
+        if (!sf_h->stale && (sf_h->fFlags & fMask) == fFlags)
+        {
+            if (!sf_h->refs++)
+            {
+                spin_lock(&sf_g->idle_lock);
+                list_del_init(&sf_h->idle_entry);
+                spin_unlock(&sf_g->idle_lock);
+            }
+            spin_unlock(&sf_i->handle_lock);
+            return sf_h;
+        }
+    }
+    spin_unlock(&sf_i->handle_lock);
+    return NULL;
+}
+
+/* close the host handle of [sf_h] which is on no list anymore */
+static void sf_handle_close(struct sf_glob_info *sf_g, struct sf_handle *sf_h)
+{
+    int rc = vboxCallClose(&client_handle, &sf_g->map, sf_h->handle);
+    if (RT_FAILURE(rc))
+        LogFunc(("vboxCallClose failed rc=%Rrc\n", rc));
+    kmem_cache_free(sf_handle_cachep, sf_h);
+}
+
+/**
+ * Drop a reference to [sf_h].  The last one puts the handle on the idle
+ * list of the mount, or closes it if it is stale or caching is disabled.
+ */
+void sf_handle_release(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                       struct sf_handle *sf_h)
+{
+    spin_lock(&sf_i->handle_lock);
+    if (--sf_h->refs)
+    {
+        spin_unlock(&sf_i->handle_lock);
+        return;
+    }
+    if (!sf_h->stale && sf_g->handle_ttl)
+    {
+        sf_h->idle_since = jiffies;
+        spin_lock(&sf_g->idle_lock);
+        list_add_tail(&sf_h->idle_entry, &sf_g->idle_handles);
+        spin_unlock(&sf_g->idle_lock);
+        spin_unlock(&sf_i->handle_lock);
+        queue_delayed_work(system_wq, &sf_g->handle_work, sf_g->handle_ttl);
+        return;
+    }
+    list_del(&sf_h->entry);
+    spin_unlock(&sf_i->handle_lock);
+
+    sf_handle_close(sf_g, sf_h);
+}
+
+/**
+ * The host file of [sf_i] may have been replaced or removed: close its
+ * unused host handles and don't hand out the others again.
+ */
+void sf_handle_invalidate(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i)
+{
+    struct sf_handle *sf_h, *tmp;
+    LIST_HEAD(closing);
+
+    spin_lock(&sf_i->handle_lock);
+    list_for_each_entry_safe(sf_h, tmp, &sf_i->handles, entry)
+    {
+        sf_h->stale = 1;
+        if (sf_h->refs)
+            continue;
+        spin_lock(&sf_g->idle_lock);
+        list_del_init(&sf_h->idle_entry);
+        spin_unlock(&sf_g->idle_lock);
+        list_move(&sf_h->entry, &closing);
+    }
+    spin_unlock(&sf_i->handle_lock);
+
+    list_for_each_entry_safe(sf_h, tmp, &closing, entry)
+        sf_handle_close(sf_g, sf_h);
+}
+
+/* close the host handles which were unused for longer than handle_ttl */
+void sf_handle_work(struct work_struct *work)
+{
+    struct sf_glob_info *sf_g = container_of(to_delayed_work(work),
+                                             struct sf_glob_info, handle_work);
+    struct sf_handle *sf_h;
+    struct sf_inode_info *sf_i;
+
+    TRACE();
+
+    spin_lock(&sf_g->idle_lock);
+    while (!list_empty(&sf_g->idle_handles))
+    {
+        sf_h = list_first_entry(&sf_g->idle_handles, struct sf_handle, idle_entry);
+        if (time_before(jiffies, sf_h->idle_since + sf_g->handle_ttl))
+        {
+            queue_delayed_work(system_wq, &sf_g->handle_work,
+                               sf_h->idle_since + sf_g->handle_ttl - jiffies);
+            break;
+        }
+
+        /* the inode lock nests outside of ours, the inode can't go away
+           while its handle is on the idle list */
+        sf_i = sf_h->sf_i;
+        if (!spin_trylock(&sf_i->handle_lock))
+        {
+            spin_unlock(&sf_g->idle_lock);
+            cpu_relax();
+            spin_lock(&sf_g->idle_lock);
+            continue;
+        }
+        list_del_init(&sf_h->idle_entry);
+        list_del(&sf_h->entry);
+        spin_unlock(&sf_i->handle_lock);
+        spin_unlock(&sf_g->idle_lock);
+
+        sf_handle_close(sf_g, sf_h);
+
+        spin_lock(&sf_g->idle_lock);
+    }
+    spin_unlock(&sf_g->idle_lock);
+}
+
+int sf_init_backing_dev(struct super_block *sb, struct sf_glob_info *sf_g)
 {
     int rc = 0;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0) && LINUX_VERSION_CODE <= KERNEL_VERSION(3, 19, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
     /* Each new shared folder map gets a new uint64_t identifier,
      * allocated in sequence.  We ASSUME the sequence will not wrap. */
     static uint64_t s_u64Sequence = 0;
     uint64_t u64CurrentSequence = ASMAtomicIncU64(&s_u64Sequence);
 
-    sf_g->bdi.ra_pages = 32;
-# if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 12)
+    /* upper limit of the per-file windows, see sf_reg_ra_adapt() */
+    sf_g->bdi.ra_pages = sf_g->ra >> PAGE_SHIFT;
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 12) && LINUX_VERSION_CODE < KERNEL_VERSION(4, 0, 0)
     sf_g->bdi.capabilities  = BDI_CAP_MAP_DIRECT    /* MAP_SHARED */
                             | BDI_CAP_MAP_COPY      /* MAP_PRIVATE */
                             | BDI_CAP_READ_MAP      /* can be mapped for reading */
                             | BDI_CAP_WRITE_MAP     /* can be mapped for writing */
                             | BDI_CAP_EXEC_MAP;     /* can be mapped for execution */
-# endif /* >= 2.6.12 */
+# endif /* >= 2.6.12 && < 4.0.0 */
 # if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
     rc = bdi_init(&sf_g->bdi);
 #  if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 26)
@@ -901,13 +1834,18 @@ int sf_init_backing_dev(struct sf_glob_info *sf_g)
                           (unsigned long long)u64CurrentSequence);
 #  endif /* >= 2.6.26 */
 # endif /* >= 2.6.24 */
-#endif /* >= 2.6.0 && <= 3.19.0 */
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
+    /* the bdi is no longer taken from the address space */
+    if (!rc)
+        sb->s_bdi = &sf_g->bdi;
+# endif
+#endif /* >= 2.6.0 */
     return rc;
 }
 
 void sf_done_backing_dev(struct sf_glob_info *sf_g)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24) && LINUX_VERSION_CODE <= KERNEL_VERSION(3, 19, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
     bdi_destroy(&sf_g->bdi); /* includes bdi_unregister() */
 #endif
 }
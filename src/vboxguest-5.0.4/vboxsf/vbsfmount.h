@@ -50,6 +50,26 @@ struct vbsf_mount_info_new
     int  fmode;                 /* mode for regular files if != 0xffffffff */
     int  dmask;                 /* umask applied to directories */
     int  fmask;                 /* umask applied to regular files */
+    int  wsize;                 /* max bytes written back per host call, 0=default */
+    int  inflight;              /* max bytes of async readahead in flight,
+                                   0=default, <0=synchronous readahead */
+    int  rsize;                 /* max bytes read per host call, 0=default */
+    int  ra;                    /* max readahead window in bytes, 0=default */
+    int  writeback;             /* cache writes and write them back later */
+    int  dirty_limit;           /* max bytes of write-back data, 0=default */
+    int  dirty_expire;          /* write back data older than this (ms),
+                                   0=default */
+    int  handle_ttl;            /* keep host handles open after the last
+                                   close (ms), 0=default, <0=never */
+    int  negttl;                /* time to live of negative dentries (ms),
+                                   0=don't keep them */
+    int  dirstream;             /* read directories in batches on demand */
+    int  acregmin;              /* attribute cache timeout of files (ms), */
+    int  acregmax;              /* growing from min to max while the */
+    int  acdirmin;              /* attributes don't change, same for */
+    int  acdirmax;              /* directories, 0=ttl */
+    int  statfs_ttl;            /* time to live of the cached volume
+                                   information (ms), 0=default, <0=no cache */
 };
 
 struct vbsf_mount_opts
@@ -61,6 +81,21 @@ struct vbsf_mount_opts
     int  fmode;
     int  dmask;
     int  fmask;
+    int  wsize;
+    int  inflight;
+    int  rsize;
+    int  ra;
+    int  writeback;
+    int  dirty_limit;
+    int  dirty_expire;
+    int  handle_ttl;
+    int  negttl;
+    int  dirstream;
+    int  acregmin;
+    int  acregmax;
+    int  acdirmin;
+    int  acdirmax;
+    int  statfs_ttl;
     int  ronly;
     int  sloppy;
     int  noexec;
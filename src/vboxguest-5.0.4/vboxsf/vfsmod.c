@@ -39,10 +39,106 @@ MODULE_VERSION(VBOX_VERSION_STRING " (interface " RT_XSTR(VMMDEV_VERSION) ")");
 
 /* globals */
 VBSFCLIENT client_handle;
+/* workers for asynchronous readahead, NULL if readahead is synchronous */
+struct workqueue_struct *sf_read_wq;
+int sf_host_symlinks;
 
 /* forward declarations */
 static struct super_operations sf_super_ops;
 
+/* does the mount info passed by mount.vboxsf contain [field]? */
+#define VBSF_MOUNT_INFO_HAS(info, field) \
+    ((unsigned)(info)->length >= RT_UOFFSETOF(struct vbsf_mount_info_new, field) + sizeof((info)->field))
+
+/* take over the I/O tuning options from [info], using defaults for
+   everything an older mount.vboxsf did not pass */
+static void sf_glob_set_io_opts(struct sf_glob_info *sf_g, struct vbsf_mount_info_new *info)
+{
+    int wsize = VBSF_MOUNT_INFO_HAS(info, wsize) ? info->wsize : 0;
+    int inflight = VBSF_MOUNT_INFO_HAS(info, inflight) ? info->inflight : 0;
+    int rsize = VBSF_MOUNT_INFO_HAS(info, rsize) ? info->rsize : 0;
+    int ra = VBSF_MOUNT_INFO_HAS(info, ra) ? info->ra : 0;
+    int dirty_limit = VBSF_MOUNT_INFO_HAS(info, dirty_limit) ? info->dirty_limit : 0;
+    int dirty_expire = VBSF_MOUNT_INFO_HAS(info, dirty_expire) ? info->dirty_expire : 0;
+    int handle_ttl = VBSF_MOUNT_INFO_HAS(info, handle_ttl) ? info->handle_ttl : 0;
+    int negttl = VBSF_MOUNT_INFO_HAS(info, negttl) ? info->negttl : 0;
+    int acregmin = VBSF_MOUNT_INFO_HAS(info, acregmin) ? info->acregmin : 0;
+    int acregmax = VBSF_MOUNT_INFO_HAS(info, acregmax) ? info->acregmax : 0;
+    int acdirmin = VBSF_MOUNT_INFO_HAS(info, acdirmin) ? info->acdirmin : 0;
+    int acdirmax = VBSF_MOUNT_INFO_HAS(info, acdirmax) ? info->acdirmax : 0;
+    int statfs_ttl = VBSF_MOUNT_INFO_HAS(info, statfs_ttl) ? info->statfs_ttl : 0;
+    unsigned long ttl;
+
+    if (wsize <= 0)
+        wsize = SF_WSIZE_DEFAULT;
+    else if (wsize > SF_WSIZE_MAX)
+        wsize = SF_WSIZE_MAX;
+    wsize &= PAGE_MASK;
+    if (!wsize)
+        wsize = PAGE_SIZE;
+    sf_g->wsize = wsize;
+
+    if (!inflight)
+        inflight = SF_INFLIGHT_DEFAULT;
+    else if (inflight < 0)
+        inflight = 0;
+    sf_g->inflight = inflight;
+
+    if (rsize <= 0)
+        rsize = SF_RSIZE_DEFAULT;
+    else if (rsize > SF_RSIZE_MAX)
+        rsize = SF_RSIZE_MAX;
+    rsize &= PAGE_MASK;
+    if (!rsize)
+        rsize = PAGE_SIZE;
+    sf_g->rsize = rsize;
+
+    if (ra <= 0)
+        ra = SF_RA_DEFAULT;
+    else if (ra > SF_RA_MAX)
+        ra = SF_RA_MAX;
+    if (ra < SF_RA_MIN_PAGES << PAGE_SHIFT)
+        ra = SF_RA_MIN_PAGES << PAGE_SHIFT;
+    sf_g->ra = ra;
+
+    sf_g->writeback = VBSF_MOUNT_INFO_HAS(info, writeback) && info->writeback;
+    if (dirty_limit <= 0)
+        dirty_limit = SF_DIRTY_LIMIT_DEFAULT;
+    if (dirty_limit < sf_g->wsize)
+        dirty_limit = sf_g->wsize;
+    sf_g->dirty_limit = dirty_limit >> PAGE_SHIFT;
+    if (dirty_expire <= 0)
+        dirty_expire = SF_DIRTY_EXPIRE_DEFAULT;
+    sf_g->dirty_expire = msecs_to_jiffies(dirty_expire);
+
+    if (!handle_ttl)
+        handle_ttl = SF_HANDLE_TTL_DEFAULT;
+    else if (handle_ttl < 0)
+        handle_ttl = 0;
+    sf_g->handle_ttl = msecs_to_jiffies(handle_ttl);
+
+    sf_g->negttl = negttl > 0 ? msecs_to_jiffies(negttl) : 0;
+
+    sf_g->dirstream = VBSF_MOUNT_INFO_HAS(info, dirstream) && info->dirstream;
+
+    /* without the options attributes are trusted for ttl, like before */
+    ttl = sf_g->ttl > 0 ? sf_g->ttl : 0;
+    sf_g->acregmin = acregmin > 0 ? msecs_to_jiffies(acregmin) : ttl;
+    sf_g->acregmax = acregmax > 0 ? msecs_to_jiffies(acregmax) : ttl;
+    if (sf_g->acregmax < sf_g->acregmin)
+        sf_g->acregmax = sf_g->acregmin;
+    sf_g->acdirmin = acdirmin > 0 ? msecs_to_jiffies(acdirmin) : ttl;
+    sf_g->acdirmax = acdirmax > 0 ? msecs_to_jiffies(acdirmax) : ttl;
+    if (sf_g->acdirmax < sf_g->acdirmin)
+        sf_g->acdirmax = sf_g->acdirmin;
+
+    if (!statfs_ttl)
+        statfs_ttl = SF_STATFS_TTL_DEFAULT;
+    else if (statfs_ttl < 0)
+        statfs_ttl = 0;
+    sf_g->statfs_ttl = msecs_to_jiffies(statfs_ttl);
+}
+
 /* allocate global info, try to map host share */
 static int sf_glob_alloc(struct vbsf_mount_info_new *info, struct sf_glob_info **sf_gp)
 {
@@ -61,6 +157,14 @@ static int sf_glob_alloc(struct vbsf_mount_info_new *info, struct sf_glob_info *
     }
 
     RT_ZERO(*sf_g);
+    spin_lock_init(&sf_g->dirty_lock);
+    INIT_LIST_HEAD(&sf_g->dirty_inodes);
+    INIT_DELAYED_WORK(&sf_g->dirty_work, sf_dirty_work);
+    spin_lock_init(&sf_g->idle_lock);
+    INIT_LIST_HEAD(&sf_g->idle_handles);
+    INIT_DELAYED_WORK(&sf_g->handle_work, sf_handle_work);
+    spin_lock_init(&sf_g->vol_lock);
+    INIT_WORK(&sf_g->vol_work, sf_vol_work);
 
     if (   info->nullchar     != '\0'
         || info->signature[0] != VBSF_MOUNT_SIGNATURE_BYTE_0
@@ -158,7 +262,7 @@ static int sf_glob_alloc(struct vbsf_mount_info_new *info, struct sf_glob_info *
     sf_g->uid = info->uid;
     sf_g->gid = info->gid;
 
-    if ((unsigned)info->length >= sizeof(struct vbsf_mount_info_new))
+    if (VBSF_MOUNT_INFO_HAS(info, fmask))
     {
         /* new fields */
         sf_g->dmode = info->dmode;
@@ -172,6 +276,8 @@ static int sf_glob_alloc(struct vbsf_mount_info_new *info, struct sf_glob_info *
         sf_g->fmode = ~0;
     }
 
+    sf_glob_set_io_opts(sf_g, info);
+
     *sf_gp = sf_g;
     return 0;
 
@@ -219,7 +325,7 @@ static int sf_read_super_aux(struct super_block *sb, void *data, int flags)
     int err;
     struct dentry *droot;
     struct inode *iroot;
-    struct sf_inode_info *sf_i;
+    struct sf_path *path;
     struct sf_glob_info *sf_g;
     SHFLFSOBJINFO fsinfo;
     struct vbsf_mount_info_new *info;
@@ -244,37 +350,22 @@ static int sf_read_super_aux(struct super_block *sb, void *data, int flags)
     if (err)
         goto fail0;
 
-    sf_i = kmalloc(sizeof (*sf_i), GFP_KERNEL);
-    if (!sf_i)
-    {
-        err = -ENOMEM;
-        LogRelFunc(("could not allocate memory for root inode info\n"));
-        goto fail1;
-    }
-
-    sf_i->handle = SHFL_HANDLE_NIL;
-    sf_i->path = kmalloc(sizeof(SHFLSTRING) + 1, GFP_KERNEL);
-    if (!sf_i->path)
+    path = sf_path_alloc(NULL, "/", 1);
+    if (!path)
     {
         err = -ENOMEM;
         LogRelFunc(("could not allocate memory for root inode path\n"));
-        goto fail2;
+        goto fail1;
     }
 
-    sf_i->path->u16Length = 1;
-    sf_i->path->u16Size = 2;
-    sf_i->path->String.utf8[0] = '/';
-    sf_i->path->String.utf8[1] = 0;
-    sf_i->force_reread = 0;
-
-    err = sf_stat(__func__, sf_g, sf_i->path, &fsinfo, 0);
+    err = sf_stat(__func__, sf_g, path, &fsinfo, 0);
     if (err)
     {
         LogFunc(("could not stat root of share\n"));
         goto fail3;
     }
 
-    sb->s_magic = 0xface;
+    sb->s_magic = VBOXSF_SUPER_MAGIC;
     sb->s_blocksize = 1024;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 3)
     /* Required for seek/sendfile.
@@ -291,6 +382,8 @@ static int sf_read_super_aux(struct super_block *sb, void *data, int flags)
 # endif
 #endif
     sb->s_op = &sf_super_ops;
+    /* evicting the root inode on failure needs it */
+    SET_GLOB_INFO(sb, sf_g);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
     iroot = iget_locked(sb, 0);
@@ -303,8 +396,10 @@ static int sf_read_super_aux(struct super_block *sb, void *data, int flags)
         LogFunc(("could not get root inode\n"));
         goto fail3;
     }
+    /* from now on the root inode owns the path */
+    GET_INODE_INFO(iroot)->path = path;
 
-    if (sf_init_backing_dev(sf_g))
+    if (sf_init_backing_dev(sb, sf_g))
     {
         err = -EINVAL;
         LogFunc(("could not init bdi\n"));
@@ -315,7 +410,7 @@ static int sf_read_super_aux(struct super_block *sb, void *data, int flags)
     }
 
     sf_init_inode(sf_g, iroot, &fsinfo);
-    SET_INODE_INFO(iroot, sf_i);
+    sf_inode_attr_reset(iroot);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 4, 25)
     unlock_new_inode(iroot);
@@ -337,7 +432,6 @@ static int sf_read_super_aux(struct super_block *sb, void *data, int flags)
     }
 
     sb->s_root = droot;
-    SET_GLOB_INFO(sb, sf_g);
     return 0;
 
 fail5:
@@ -346,12 +440,13 @@ fail5:
 fail4:
     if (fInodePut)
         iput(iroot);
+    goto fail2;
 
 fail3:
-    kfree(sf_i->path);
+    sf_path_put(path);
 
 fail2:
-    kfree(sf_i);
+    SET_GLOB_INFO(sb, NULL);
 
 fail1:
     sf_glob_free(sf_g);
@@ -380,21 +475,23 @@ sf_read_super_24(struct super_block *sb, void *data, int flags)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
 static void sf_clear_inode(struct inode *inode)
 {
+    struct sf_glob_info *sf_g;
     struct sf_inode_info *sf_i;
 
     TRACE();
     sf_i = GET_INODE_INFO(inode);
-    if (!sf_i)
-        return;
-
-    BUG_ON(!sf_i->path);
-    kfree(sf_i->path);
-    kfree(sf_i);
-    SET_INODE_INFO(inode, NULL);
+    sf_g = GET_GLOB_INFO(inode->i_sb);
+    spin_lock(&sf_g->dirty_lock);
+    list_del_init(&sf_i->dirty_entry);
+    spin_unlock(&sf_g->dirty_lock);
+    /* all files are closed, this closes the cached host handles */
+    sf_handle_invalidate(sf_g, sf_i);
+    sf_dir_cache_drop(sf_i);
 }
 #else
 static void sf_evict_inode(struct inode *inode)
 {
+    struct sf_glob_info *sf_g;
     struct sf_inode_info *sf_i;
 
     TRACE();
@@ -406,16 +503,48 @@ static void sf_evict_inode(struct inode *inode)
 # endif
 
     sf_i = GET_INODE_INFO(inode);
+    sf_g = GET_GLOB_INFO(inode->i_sb);
+    spin_lock(&sf_g->dirty_lock);
+    list_del_init(&sf_i->dirty_entry);
+    spin_unlock(&sf_g->dirty_lock);
+    /* all files are closed, this closes the cached host handles */
+    sf_handle_invalidate(sf_g, sf_i);
+    sf_dir_cache_drop(sf_i);
+}
+#endif
+
+/* allocate an inode together with our [sf_inode_info] */
+static struct inode *sf_alloc_inode(struct super_block *sb)
+{
+    struct sf_inode_info *sf_i = sf_inode_info_alloc();
+
     if (!sf_i)
-        return;
+        return NULL;
+    return &sf_i->vfs_inode;
+}
 
-    BUG_ON(!sf_i->path);
-    kfree(sf_i->path);
-    kfree(sf_i);
-    SET_INODE_INFO(inode, NULL);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+static void sf_free_inode_rcu(struct rcu_head *head)
+{
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+
+    sf_inode_info_free(GET_INODE_INFO(inode));
 }
 #endif
 
+static void sf_destroy_inode(struct inode *inode)
+{
+    /* not in evict: sf_inode_test() looks at the path of inodes being
+       evicted until they are unhashed */
+    sf_path_put(GET_INODE_INFO(inode)->path);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+    /* RCU path walk may still look at the attribute cache state */
+    call_rcu(&inode->i_rcu, sf_free_inode_rcu);
+#else
+    sf_inode_info_free(GET_INODE_INFO(inode));
+#endif
+}
+
 /* this is called by vfs when it wants to populate [inode] with data.
    the only thing that is known about inode at this point is its index
    hence we can't do anything here, and let lookup/whatever with the
@@ -434,6 +563,9 @@ static void sf_put_super(struct super_block *sb)
 
     sf_g = GET_GLOB_INFO(sb);
     BUG_ON(!sf_g);
+    cancel_delayed_work_sync(&sf_g->dirty_work);
+    cancel_delayed_work_sync(&sf_g->handle_work);
+    cancel_work_sync(&sf_g->vol_work);
     sf_done_backing_dev(sf_g);
     sf_glob_free(sf_g);
 }
@@ -477,6 +609,10 @@ static int sf_remount_fs(struct super_block *sb, int *flags, char *data)
             sf_g->fmode = info->fmode;
             sf_g->dmask = info->dmask;
             sf_g->fmask = info->fmask;
+            sf_glob_set_io_opts(sf_g, info);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+            sf_g->bdi.ra_pages = sf_g->ra >> PAGE_SHIFT;
+#endif
         }
     }
 
@@ -497,6 +633,8 @@ static int sf_remount_fs(struct super_block *sb, int *flags, char *data)
 
 static struct super_operations sf_super_ops =
 {
+    .alloc_inode   = sf_alloc_inode,
+    .destroy_inode = sf_destroy_inode,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
     .clear_inode = sf_clear_inode,
 #else
@@ -587,10 +725,21 @@ static int __init init(void)
         return -EINVAL;
     }
 
+    err = sf_caches_init();
+    if (err)
+    {
+        LogRelFunc(("could not create slab caches\n"));
+        return err;
+    }
+
+    sf_bounce_init();
+
     err = register_filesystem(&vboxsf_fs_type);
     if (err)
     {
         LogFunc(("register_filesystem err=%d\n", err));
+        sf_bounce_done();
+        sf_caches_done();
         return err;
     }
 
@@ -628,6 +777,18 @@ static int __init init(void)
                      "vboxsf: Host unable to show symlinks, rc=%d\n",
                      rcVBox);
         }
+        else
+            sf_host_symlinks = 1;
+    }
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+    sf_read_wq = alloc_workqueue("vboxsf_read", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (!sf_read_wq)
+    {
+        LogRelFunc(("could not create readahead workqueue\n"));
+        rcRet = -ENOMEM;
+        goto fail2;
     }
 #endif
 
@@ -645,6 +806,8 @@ fail1:
 
 fail0:
     unregister_filesystem(&vboxsf_fs_type);
+    sf_bounce_done();
+    sf_caches_done();
     return rcRet;
 }
 
@@ -652,9 +815,13 @@ static void __exit fini(void)
 {
     TRACE();
 
+    if (sf_read_wq)
+        destroy_workqueue(sf_read_wq);
     vboxDisconnect(&client_handle);
     vboxUninit();
     unregister_filesystem(&vboxsf_fs_type);
+    sf_bounce_done();
+    sf_caches_done();
 }
 
 module_init(init);
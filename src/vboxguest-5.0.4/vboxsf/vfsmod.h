@@ -32,18 +32,103 @@
 
 #define DIR_BUFFER_SIZE (16*_1K)
 
+/* default and maximum size of a single write-back request */
+#define SF_WSIZE_DEFAULT (1*_1M)
+#define SF_WSIZE_MAX     (8*_1M)
+
+/* default limit of the memory of the directory listings cached on the
+   inodes of all mounts */
+#define SF_DIR_CACHE_SIZE_DEFAULT (4*_1M)
+
+/* default per-mount limit of asynchronous readahead in flight */
+#define SF_INFLIGHT_DEFAULT (4*_1M)
+
+/* default and maximum size of a single host read */
+#define SF_RSIZE_DEFAULT (1*_1M)
+#define SF_RSIZE_MAX     (8*_1M)
+
+/* readahead window: default mount maximum, upper limit of the mount
+   maximum, and the per-file start and minimum (in pages) */
+#define SF_RA_DEFAULT    (4*_1M)
+#define SF_RA_MAX        (64*_1M)
+#define SF_RA_INIT_PAGES 32
+#define SF_RA_MIN_PAGES  4
+
+/* write-back mode: default per-mount limit of dirty data and default
+   age (ms) after which dirty data is written back */
+#define SF_DIRTY_LIMIT_DEFAULT  (16*_1M)
+#define SF_DIRTY_EXPIRE_DEFAULT 5000
+
+/* default time (ms) host handles are kept open after the last close */
+#define SF_HANDLE_TTL_DEFAULT 1000
+
+/* default time (ms) statfs answers from the cached volume information */
+#define SF_STATFS_TTL_DEFAULT 1000
+
+/* f_type of statfs and s_magic, "VBox" */
+#define VBOXSF_SUPER_MAGIC 0x786f4256
+
 /* per-shared folder information */
 struct sf_glob_info
 {
     VBSFMAP map;
     struct nls_table *nls;
     int ttl;
+    /* attribute cache timeouts (jiffies) of files and directories: an
+       inode's timeout starts at min and doubles up to max with every
+       revalidation which finds its attributes unchanged */
+    unsigned long acregmin;
+    unsigned long acregmax;
+    unsigned long acdirmin;
+    unsigned long acdirmax;
+    /* time to live of negative dentries (jiffies), 0=don't keep them */
+    unsigned long negttl;
     int uid;
     int gid;
     int dmode;
     int fmode;
     int dmask;
     int fmask;
+    /* max bytes per write-back host call, multiple of PAGE_SIZE */
+    int wsize;
+    /* max bytes of asynchronous readahead in flight */
+    int inflight;
+    /* bytes of asynchronous readahead currently in flight */
+    atomic_t inflight_bytes;
+    /* max bytes per host read, multiple of PAGE_SIZE */
+    int rsize;
+    /* max per-file readahead window in bytes */
+    int ra;
+    /* write-back mode: write_end only dirties the page cache */
+    int writeback;
+    /* write-back mode: max dirty pages before writers flush, and
+       age (jiffies) after which dirty inodes are written back */
+    long dirty_limit;
+    unsigned long dirty_expire;
+    /* pages dirtied and not yet written back (approximate) */
+    atomic_long_t dirty_pages;
+    /* inodes with dirty pages in order of dirtying (sf_inode_info) */
+    spinlock_t dirty_lock;
+    struct list_head dirty_inodes;
+    struct delayed_work dirty_work;
+    /* readdir fetches the listing batch by batch from an open host handle
+       instead of reading it completely on open */
+    int dirstream;
+    /* how long (jiffies) unused host handles are kept open, 0=not at all */
+    unsigned long handle_ttl;
+    /* unused host handles, oldest first (sf_handle::idle_entry) */
+    spinlock_t idle_lock;
+    struct list_head idle_handles;
+    struct delayed_work handle_work;
+    /* statfs answers from vol_info for statfs_ttl (jiffies, 0=always asks
+       the host) after vol_time, and for another statfs_ttl while vol_work
+       refreshes it in the background; vol_lock protects the three */
+    unsigned long statfs_ttl;
+    spinlock_t vol_lock;
+    SHFLVOLINFO vol_info;
+    unsigned long vol_time;
+    int vol_valid;
+    struct work_struct vol_work;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
     struct backing_dev_info bdi;
 #endif
@@ -52,22 +137,90 @@ struct sf_glob_info
 /* per-inode information */
 struct sf_inode_info
 {
-    /* which file */
-    SHFLSTRING *path;
+    /* our component of the host path */
+    struct sf_path *path;
     /* some information was changed, update data on next revalidate */
     int force_restat;
     /* directory content changed, update the whole directory on next sf_getdent */
     int force_reread;
-    /* file structure, only valid between open() and release() */
-    struct file *file;
-    /* handle valid if a file was created with sf_create_aux until it will
-     * be opened with sf_reg_open() */
+    /* when the attributes were fetched from the host and how long they
+       are trusted (jiffies) */
+    unsigned long attr_time;
+    unsigned long attr_timeo;
+    /* host object id (Unix hosts), 0 if the inode number is made up */
+    RTINODE host_ino;
+    RTDEV host_dev;
+    /* last local create/rename/symlink in the directory, negative dentries
+       looked up before are stale */
+    unsigned long dir_stamp;
+    /* the last listing read from the host, valid until force_reread is set,
+       the pointer is protected by sf_dir_cache_lock */
+    struct sf_dir_info *dir_cache;
+    /* handle valid if a file was created with sf_create_aux or opened by
+     * sf_atomic_open until it will be opened with sf_reg_open(), and the
+     * SHFL_CF_ACCESS_* flags it was opened with, protected by handle_lock */
+    SHFLHANDLE handle;
+    uint32_t handle_flags;
+    /* open host handles (struct sf_handle), protected by handle_lock */
+    struct list_head handles;
+    spinlock_t handle_lock;
+    /* entry in sf_glob_info::dirty_inodes, protected by its dirty_lock */
+    struct list_head dirty_entry;
+    /* when the inode was put on the dirty list and the inode itself,
+       both only valid while it is on that list */
+    unsigned long dirtied_when;
+    struct inode *inode;
+    /* fsync group commit: number of host flushes started and completed
+       and the result of the last one, flush_mutex serializes the flushes
+       and flush_lock protects the counters */
+    struct mutex flush_mutex;
+    spinlock_t flush_lock;
+    unsigned long flush_started;
+    unsigned long flush_done;
+    int flush_err;
+    /* the VFS inode, allocated together with this by sf_alloc_inode() */
+    struct inode vfs_inode;
+};
+
+/* host file handle, shared by the open files of an inode and write-back
+   and cached for sf_glob_info::handle_ttl after the last reference is gone */
+struct sf_handle
+{
+    /* entry in sf_inode_info::handles */
+    struct list_head entry;
+    /* entry in sf_glob_info::idle_handles while unused */
+    struct list_head idle_entry;
+    /* the inode the handle belongs to */
+    struct sf_inode_info *sf_i;
+    /* references, protected by sf_inode_info::handle_lock */
+    int refs;
+    /* the host file may have changed, close with the last reference */
+    int stale;
+    /* when the last reference was dropped */
+    unsigned long idle_since;
+    /* SHFL_CF_ACCESS_* flags the handle was opened with */
+    uint32_t fFlags;
     SHFLHANDLE handle;
 };
 
+/* directory listing, shared by the open files of the directory */
 struct sf_dir_info
 {
+    /* references: sf_inode_info::dir_cache and each open file */
+    atomic_t refs;
     struct list_head info_list;
+    /* all entries of info_list in listing order, built on first use so
+       that finding the entry at a directory position is O(1) */
+    SHFLDIRINFO **index;
+    size_t cEntries;
+    /* when the listing was read from the host (jiffies, set right before
+       the read) */
+    unsigned long fetched;
+    /* while cached on [sf_i]: entry in the list of all cached listings,
+       least recently used first, and the memory accounted for it */
+    struct list_head lru;
+    struct sf_inode_info *sf_i;
+    size_t cbCached;
 };
 
 struct sf_dir_buf
@@ -79,13 +232,54 @@ struct sf_dir_buf
     struct list_head head;
 };
 
+/* names up to this length are stored in sf_path::iname */
+#define SF_PATH_INLINE_LEN 31
+
+/* one component of a host path (see utils.c) */
+struct sf_path
+{
+    atomic_t refs;
+    /* NULL for the root of the share */
+    struct sf_path *parent;
+    /* utf8 name, "/" for the root, points to iname if it fits */
+    char *name;
+    size_t len;
+    char iname[SF_PATH_INLINE_LEN + 1];
+};
+
+/* per open file state of a directory */
+struct sf_dir_file
+{
+    /* the shared listing, NULL while streaming */
+    struct sf_dir_info *sf_d;
+    /* dirstream: open host handle, the current batch and the directory
+       position of its first entry */
+    SHFLHANDLE handle;
+    struct sf_dir_buf *b;
+    loff_t b_pos;
+    /* when the current batch was read from the host (jiffies) */
+    unsigned long b_time;
+    /* entry of the batch looked at last and its index */
+    SHFLDIRINFO *cur;
+    size_t cur_idx;
+    /* the host has no more entries */
+    int eof;
+};
+
 struct sf_reg_info
 {
+    /* host handle of the file, sf_h->handle */
     SHFLHANDLE handle;
+    struct sf_handle *sf_h;
+    /* file position a sequential read would continue at */
+    loff_t ra_next;
 };
 
 /* globals */
 extern VBSFCLIENT client_handle;
+extern struct workqueue_struct *sf_read_wq;
+/* the host shows symlinks instead of resolving them */
+extern int sf_host_symlinks;
 
 /* forward declarations */
 extern struct inode_operations         sf_dir_iops;
@@ -95,12 +289,19 @@ extern struct file_operations          sf_dir_fops;
 extern struct file_operations          sf_reg_fops;
 extern struct dentry_operations        sf_dentry_ops;
 extern struct address_space_operations sf_reg_aops;
+extern struct address_space_operations sf_lnk_aops;
 
 extern void sf_init_inode(struct sf_glob_info *sf_g, struct inode *inode,
                           PSHFLFSOBJINFO info);
 extern int  sf_stat(const char *caller, struct sf_glob_info *sf_g,
-                    SHFLSTRING *path, PSHFLFSOBJINFO result, int ok_to_fail);
+                    struct sf_path *path, PSHFLFSOBJINFO result, int ok_to_fail);
+extern ino_t sf_host_ino(PSHFLFSOBJINFO info);
+extern void sf_inode_refresh(struct inode *inode, PSHFLFSOBJINFO info);
+extern void sf_inode_attr_reset(struct inode *inode);
+extern int  sf_inode_attr_fresh(struct inode *inode);
+extern void sf_inode_update(struct dentry *dentry, PSHFLFSOBJINFO info);
 extern int  sf_inode_revalidate(struct dentry *dentry);
+extern uint32_t sf_access_flags(unsigned f_flags);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
 extern int  sf_getattr(struct vfsmount *mnt, struct dentry *dentry,
                        struct kstat *kstat);
@@ -108,16 +309,53 @@ extern int  sf_setattr(struct dentry *dentry, struct iattr *iattr);
 #endif
 extern int  sf_path_from_dentry(const char *caller, struct sf_glob_info *sf_g,
                                 struct sf_inode_info *sf_i, struct dentry *dentry,
-                                SHFLSTRING **result);
+                                struct sf_path **result);
+extern struct sf_path *sf_path_alloc(struct sf_path *parent, const char *name, size_t len);
+extern void sf_path_put(struct sf_path *p);
+extern void sf_path_move(struct sf_path *p, struct sf_path *to);
+extern int  sf_path_equal(struct sf_path *p, struct sf_path *q);
+extern SHFLSTRING *sf_path_str(struct sf_path *p);
+extern SHFLSTRING *sf_path_str_name(struct sf_path *p, const char *name, size_t len);
+extern void sf_path_str_done(SHFLSTRING *str);
+extern int  sf_make_path(const char *caller, struct sf_path *p,
+                         const char *d_name, size_t d_len, SHFLSTRING **result);
+extern void sf_free_path(SHFLSTRING *str);
 extern int  sf_nlscpy(struct sf_glob_info *sf_g,
                       char *name, size_t name_bound_len,
                       const unsigned char *utf8_name, size_t utf8_len);
 extern void sf_dir_info_free(struct sf_dir_info *p);
+extern void sf_dir_info_put(struct sf_dir_info *p);
+extern struct sf_dir_buf *sf_dir_buf_alloc(void);
+extern void sf_dir_buf_free(struct sf_dir_buf *b);
+extern int sf_dir_read_batch(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                             SHFLHANDLE handle, struct sf_dir_buf *b);
 extern void sf_dir_info_empty(struct sf_dir_info *p);
 extern struct sf_dir_info *sf_dir_info_alloc(void);
+extern void sf_dir_cache_drop(struct sf_inode_info *sf_i);
+extern int  sf_dir_info_index(struct sf_dir_info *sf_d);
 extern int  sf_dir_read_all(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
                             struct sf_dir_info *sf_d, SHFLHANDLE handle);
-extern int  sf_init_backing_dev(struct sf_glob_info *sf_g);
+extern struct sf_inode_info *sf_inode_info_alloc(void);
+extern void sf_inode_info_free(struct sf_inode_info *sf_i);
+extern struct sf_reg_info *sf_reg_info_alloc(void);
+extern void sf_reg_info_free(struct sf_reg_info *sf_r);
+extern struct sf_dir_file *sf_dir_file_alloc(void);
+extern void sf_dir_file_free(struct sf_dir_file *sf_f);
+extern int  sf_caches_init(void);
+extern void sf_caches_done(void);
+extern void sf_bounce_init(void);
+extern void sf_bounce_done(void);
+extern struct sf_handle *sf_handle_add(struct sf_inode_info *sf_i, SHFLHANDLE handle,
+                                       uint32_t fFlags);
+extern struct sf_handle *sf_handle_find(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                                        uint32_t fFlags, uint32_t fMask);
+extern void sf_handle_release(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i,
+                              struct sf_handle *sf_h);
+extern void sf_handle_invalidate(struct sf_glob_info *sf_g, struct sf_inode_info *sf_i);
+extern void sf_handle_work(struct work_struct *work);
+extern void sf_dirty_work(struct work_struct *work);
+extern void sf_vol_work(struct work_struct *work);
+extern int  sf_init_backing_dev(struct super_block *sb, struct sf_glob_info *sf_g);
 extern void sf_done_backing_dev(struct sf_glob_info *sf_g);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
@@ -145,15 +383,8 @@ int sf_get_volume_info(struct super_block *sb,STRUCT_STATFS *stat);
 # define SET_GLOB_INFO(sb, sf_g) (sb)->s_fs_info = sf_g
 #endif
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 19) || defined(KERNEL_FC6)
-/* FC6 kernel 2.6.18, vanilla kernel 2.6.19+ */
-# define GET_INODE_INFO(i)       ((struct sf_inode_info *) (i)->i_private)
-# define SET_INODE_INFO(i, sf_i) (i)->i_private = sf_i
-#else
-/* vanilla kernel up to 2.6.18 */
-# define GET_INODE_INFO(i)       ((struct sf_inode_info *) (i)->u.generic_ip)
-# define SET_INODE_INFO(i, sf_i) (i)->u.generic_ip = sf_i
-#endif
+/* all our inodes are allocated by sf_alloc_inode() */
+#define GET_INODE_INFO(i)       container_of(i, struct sf_inode_info, vfs_inode)
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
 # define GET_F_DENTRY(f)        (f->f_path.dentry)